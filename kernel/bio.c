@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,23 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Buffers are hashed on (dev, blockno) into NBUCKET buckets,
+// each with its own lock, so lookups of different blocks
+// rarely contend. bcache.lock is only taken on a miss, to
+// serialize the choice of a buffer to recycle: the unused
+// buffer with the oldest lastuse time stamp.
+//
+// Buffer data lives in pages from kalloc(), BPP buffers to a
+// page. binit() sizes the cache from the amount of free memory;
+// a miss adds a page of buffers while memory is plentiful, and
+// kalloc() calls bshrink() to take idle pages back when it
+// runs out.
+//
+// breadahead() starts reads of blocks that a sequential reader
+// will soon want and releases the buffers right away, with the
+// disk still busy on them; such a buffer has b->disk set, so it
+// is never recycled, and bread() waits for the read to finish.
 
 
 #include "types.h"
@@ -22,32 +39,238 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
 
-struct {
+#define NBUCKET 13
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+#define BUCKET(b) (&bcache.bucket[BHASH((b)->dev, (b)->blockno)])
+
+#define BPP       (PGSIZE/BSIZE)  // buffers per page of data
+#define NGROUP    (NBUF/BPP)      // buf[g*BPP..] share page[g]
+#define BCACHEDIV 64    // binit() uses 1/BCACHEDIV of free memory
+#define BGROWFREE 1024  // grow on a miss while this many pages are free
+#define BRUN      16    // most consecutive blocks in one disk request
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;
+  uint64 hits;
+  uint64 rahits;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+struct {
+  struct spinlock lock;   // serializes recycling, growing and shrinking
+  struct buf buf[NBUF];
+  char *page[NGROUP];     // data page of a group of buffers, or 0
+  int nbuf;               // buffers with a data page
+  uint64 misses;
+  uint64 prefetched;
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static int bgrow(void);
+static void bqueue(struct buf**, int, int);
+static void bkick(uint);
+
 void
 binit(void)
 {
   struct buf *b;
+  int i, n;
 
   initlock(&bcache.lock, "bcache");
-
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+  for(b = bcache.buf; b < bcache.buf+NBUF; b++)
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+
+  n = kfreepages() / BCACHEDIV;
+  if(n > NGROUP)
+    n = NGROUP;
+  if(n * BPP < NBUFMIN)
+    n = (NBUFMIN + BPP - 1) / BPP;
+  for(i = 0; i < n; i++)
+    if(bgrow() == 0)
+      panic("binit");
+}
+
+// Insert b into its bucket.
+static void
+blink(struct buf *b)
+{
+  struct bucket *bk = BUCKET(b);
+
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+}
+
+// Find the buffer for block blockno on device dev in bucket bk.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Remove b from bucket bk. Caller must hold bk->lock.
+static void
+bunlink(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp; pp = &(*pp)->next){
+    if(*pp == b){
+      *pp = b->next;
+      b->next = 0;
+      return;
+    }
+  }
+  panic("bunlink");
+}
+
+// Pick the least recently used unreferenced buffer and take
+// it out of its bucket. Caller must hold bcache.lock.
+// Returns 0 if every buffer is in use.
+static struct buf*
+brecycle(void)
+{
+  struct buf *b, *lru;
+  struct bucket *bk, *lrubk;
+
+  for(;;){
+    lru = 0;
+    lrubk = 0;
+    for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+      acquire(&bk->lock);
+      for(b = bk->head; b; b = b->next){
+        if(b->refcnt == 0 && !b->disk &&
+           (lru == 0 || b->lastuse < lru->lastuse)){
+          lru = b;
+          lrubk = bk;
+        }
+      }
+      release(&bk->lock);
+    }
+    if(lru == 0)
+      return 0;
+
+    // a hit in lrubk may have claimed lru since we looked.
+    acquire(&lrubk->lock);
+    if(lru->refcnt == 0 && !lru->disk){
+      bunlink(lrubk, lru);
+      release(&lrubk->lock);
+      return lru;
+    }
+    release(&lrubk->lock);
+  }
+}
+
+// Add a page of BPP empty buffers to the cache.
+// Returns 0 if the cache is full or memory is short.
+static int
+bgrow(void)
+{
+  struct buf *b;
+  char *pa;
+  int g, i;
+
+  // kalloc() may call bshrink(), so no locks here.
+  if((pa = kalloc()) == 0)
+    return 0;
+
+  acquire(&bcache.lock);
+  for(g = 0; g < NGROUP; g++)
+    if(bcache.page[g] == 0)
+      break;
+  if(g == NGROUP){
+    release(&bcache.lock);
+    kfree(pa);
+    return 0;
+  }
+  bcache.page[g] = pa;
+  for(i = 0; i < BPP; i++){
+    b = &bcache.buf[g*BPP + i];
+    b->data = (uchar*)pa + i*BSIZE;
+    b->dev = -1;
+    b->blockno = g*BPP + i;
+    b->valid = 0;
+    b->refcnt = 0;
+    b->lastuse = 0;
+    b->ra = 0;
+    blink(b);
+  }
+  bcache.nbuf += BPP;
+  release(&bcache.lock);
+  return 1;
+}
+
+// Take group g's buffers out of the cache if none is in use.
+// Caller must hold bcache.lock, so nothing is being recycled.
+static int
+bdrop(int g)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int i, j;
+
+  for(i = 0; i < BPP; i++){
+    b = &bcache.buf[g*BPP + i];
+    bk = BUCKET(b);
+    acquire(&bk->lock);
+    if(b->refcnt != 0 || b->disk){
+      release(&bk->lock);
+      // put back the ones already taken out.
+      for(j = 0; j < i; j++)
+        blink(&bcache.buf[g*BPP + j]);
+      return 0;
+    }
+    bunlink(bk, b);
+    release(&bk->lock);
+  }
+  return 1;
+}
+
+// Give up to n pages of idle buffers back to kalloc,
+// never going below NBUFMIN buffers.
+// Returns the number of pages freed.
+int
+bshrink(int n)
+{
+  char *pa;
+  int g, freed;
+
+  freed = 0;
+  acquire(&bcache.lock);
+  for(g = 0; g < NGROUP && freed < n && bcache.nbuf - BPP >= NBUFMIN; g++){
+    if(bcache.page[g] == 0 || bdrop(g) == 0)
+      continue;
+    pa = bcache.page[g];
+    bcache.page[g] = 0;
+    bcache.nbuf -= BPP;
+    kfree(pa);
+    freed++;
+  }
+  release(&bcache.lock);
+  return freed;
+}
+
+// Count a cache hit on b and take a reference to it.
+// Caller must hold bk->lock.
+static void
+bhit(struct bucket *bk, struct buf *b)
+{
+  b->refcnt++;
+  bk->hits++;
+  if(b->ra){
+    b->ra = 0;
+    bk->rahits++;
   }
 }
 
@@ -58,32 +281,60 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
-
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  int grown;
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    bhit(bk, b);
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
+
+  // Not cached. Grow the cache if memory is plentiful,
+  // so that the recycled buffer is a fresh one.
+  // nbuf is read without the lock; it is only a hint.
+  grown = 0;
+  if(bcache.nbuf < NBUF && kfreepages() >= BGROWFREE)
+    grown = bgrow();
 
-  // Not cached; recycle an unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // Another process may have missed on the same block and
+  // inserted it while we waited for bcache.lock, so look again.
+  for(;;){
+    acquire(&bcache.lock);
+    acquire(&bk->lock);
+    if((b = bfind(bk, dev, blockno)) != 0){
+      bhit(bk, b);
+      release(&bk->lock);
       release(&bcache.lock);
       acquiresleep(&b->lock);
       return b;
     }
+    release(&bk->lock);
+
+    if((b = brecycle()) != 0)
+      break;
+    release(&bcache.lock);
+
+    // every buffer is in use; try once to add more.
+    if(grown || (grown = bgrow()) == 0)
+      panic("bget: no buffers");
   }
-  panic("bget: no buffers");
+
+  bcache.misses++;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->ra = 0;
+  b->refcnt = 1;
+  blink(b);
+  release(&bcache.lock);
+
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,8 +345,10 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b->dev, b, 0);
-    b->valid = 1;
+    bstart(&b, 1, 0);
+    bwait(b);
+  } else if(b->disk) {
+    bwait(b);  // read ahead, and still on its way
   }
   return b;
 }
@@ -106,46 +359,204 @@ bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b->dev, b, 1);
+  bstart(&b, 1, 1);
+  bwait(b);
+}
+
+// Start reading or writing n locked buffers, without waiting
+// for the disk. The buffers are sorted by block number, and
+// each run of consecutive blocks goes to the disk as a single
+// request. All of the requests for a device are queued before
+// it is told about any of them, so the device sees the whole
+// batch at once. A read marks the buffers valid, since their
+// contents will be by the time bwait() returns.
+// The caller must bwait() for each buffer before using it.
+void
+bstart(struct buf **bs, int n, int write)
+{
+  struct buf *b;
+  int i, j;
+  uint devs;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bstart");
+    // insertion sort; batches are small.
+    b = bs[i];
+    for(j = i; j > 0 && (bs[j-1]->dev > b->dev ||
+        (bs[j-1]->dev == b->dev && bs[j-1]->blockno > b->blockno)); j--)
+      bs[j] = bs[j-1];
+    bs[j] = b;
+  }
+
+  devs = 0;
+  for(i = 0; i < n; i += j){
+    for(j = 1; i+j < n && j < BRUN; j++)
+      if(bs[i+j]->dev != bs[i]->dev || bs[i+j]->blockno != bs[i]->blockno + j)
+        break;
+    bqueue(&bs[i], j, write);
+    devs |= 1 << bs[i]->dev;
+  }
+  bkick(devs);
+}
+
+// Queue one disk request for the n locked buffers in bs[],
+// which hold consecutive blocks, without telling the device.
+static void
+bqueue(struct buf **bs, int n, int write)
+{
+  int i;
+
+  virtio_disk_start(bs[0]->dev, bs, n, write);
+  if(!write)
+    for(i = 0; i < n; i++)
+      bs[i]->valid = 1;
+}
+
+// Tell each device in the bit mask devs about its queued requests.
+static void
+bkick(uint devs)
+{
+  int dev;
+
+  for(dev = 0; devs; dev++, devs >>= 1)
+    if(devs & 1)
+      virtio_disk_kick(dev);
+}
+
+// Queue a read of the run of n fresh buffers in run[],
+// and release them with the disk still busy on them.
+static void
+bflushrun(struct buf **run, int n)
+{
+  int i;
+
+  if(n == 0)
+    return;
+  bqueue(run, n, 0);
+  for(i = 0; i < n; i++){
+    run[i]->ra = 1;
+    brelse(run[i]);
+  }
+}
+
+// Start reading the n blocks in blocks[] on device dev into
+// the cache, without waiting for them. Blocks that are
+// already cached are skipped. Runs of consecutive blocks
+// are read with one request each.
+void
+breadahead(uint dev, uint *blocks, int n)
+{
+  struct buf *b, *run[BRUN];
+  struct bucket *bk;
+  int i, nrun, queued;
+
+  queued = 0;
+  nrun = 0;
+  for(i = 0; i < n; i++){
+    // don't wait for a cached buffer's lock.
+    bk = &bcache.bucket[BHASH(dev, blocks[i])];
+    acquire(&bk->lock);
+    b = bfind(bk, dev, blocks[i]);
+    release(&bk->lock);
+    if(b)
+      continue;
+
+    if(nrun == BRUN || (nrun > 0 && blocks[i] != run[nrun-1]->blockno + 1)){
+      bflushrun(run, nrun);
+      nrun = 0;
+    }
+
+    // the buffers of the current run stay locked while we get
+    // the next one; they were not cached a moment ago, so only
+    // readers of those same blocks can be waiting for them.
+    b = bget(dev, blocks[i]);
+    if(b->valid){
+      brelse(b);
+      continue;
+    }
+    run[nrun++] = b;
+    queued++;
+  }
+  bflushrun(run, nrun);
+  if(queued == 0)
+    return;
+  bkick(1 << dev);
+
+  acquire(&bcache.lock);
+  bcache.prefetched += queued;
+  release(&bcache.lock);
+}
+
+// Wait for the disk to finish with b, after bstart().
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  virtio_disk_wait(b->dev, b);
 }
 
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Stamp it with the current time for LRU recycling.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = BUCKET(b);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+    b->lastuse = ticks;
+  }
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = BUCKET(b);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = BUCKET(b);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 
+// Report buffer cache statistics.
+void
+bstat(struct bcstat *st)
+{
+  struct bucket *bk;
+
+  st->nbuf = bcache.nbuf;
+  st->maxbuf = NBUF;
+  st->hits = 0;
+  st->rahits = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    acquire(&bk->lock);
+    st->hits += bk->hits;
+    st->rahits += bk->rahits;
+    release(&bk->lock);
+  }
+  acquire(&bcache.lock);
+  st->misses = bcache.misses;
+  st->prefetched = bcache.prefetched;
+  release(&bcache.lock);
+  st->readahead = readahead;
+}
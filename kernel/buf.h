@@ -5,8 +5,9 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
+  uint lastuse; // ticks at last release, for LRU eviction
+  int ra;       // read ahead, and not yet asked for
+  struct buf *next; // hash bucket chain
+  uchar *data;      // BSIZE bytes, in a page shared with other bufs
 };
 
@@ -60,19 +60,26 @@ struct {
 //
 // user write()s to the console go here.
 //
+// the bytes are copied in a buffer at a time without
+// cons.lock held, since the copy may have to page in
+// user memory, and sleep.
 int
 consolewrite(struct file *f, int user_src, uint64 src, int n)
 {
-  int i;
+  int i, j, m;
+  char buf[INPUT_BUF];
 
-  acquire(&cons.lock);
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  for(i = 0; i < n; i += m){
+    m = n - i;
+    if(m > sizeof(buf))
+      m = sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    consputc(c);
+    acquire(&cons.lock);
+    for(j = 0; j < m; j++)
+      consputc(buf[j]);
+    release(&cons.lock);
   }
-  release(&cons.lock);
 
   return n;
 }
@@ -81,15 +88,19 @@ consolewrite(struct file *f, int user_src, uint64 src, int n)
 // user read()s from the console go here.
 // copy (up to) a whole input line to dst.
 // user_dist indicates whether dst is a user
-// or kernel address.
+// or kernel address. the line is gathered in
+// a buffer and copied out after cons.lock is
+// released, as in consolewrite().
 //
 int
 consoleread(struct file *f, int user_dst, uint64 dst, int n)
 {
   uint target;
   int c;
-  char cbuf;
+  char buf[INPUT_BUF];
 
+  if(n > sizeof(buf))
+    n = sizeof(buf);
   target = n;
   acquire(&cons.lock);
   while(n > 0){
@@ -114,12 +125,7 @@ consoleread(struct file *f, int user_dst, uint64 dst, int n)
       break;
     }
 
-    // copy the input byte to the user-space buffer.
-    cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
-      break;
-
-    dst++;
+    buf[target - n] = c;
     --n;
 
     if(c == '\n'){
@@ -130,6 +136,9 @@ consoleread(struct file *f, int user_dst, uint64 dst, int n)
   }
   release(&cons.lock);
 
+  // copy the input bytes to the user-space buffer.
+  if(either_copyout(user_dst, dst, buf, target - n) == -1)
+    return -1;
   return target - n;
 }
 
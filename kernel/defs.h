@@ -1,7 +1,9 @@
+struct bcstat;
 struct buf;
 struct context;
 struct file;
 struct inode;
+struct page;
 struct pipe;
 struct proc;
 struct spinlock;
@@ -14,8 +16,13 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bstart(struct buf**, int, int);
+void            bwait(struct buf*);
+void            breadahead(uint, uint*, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(int);
+void            bstat(struct bcstat*);
 
 // console.c
 void            consoleinit(void);
@@ -24,6 +31,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execfault(struct proc*, uint64, int);
 
 // file.c
 struct file*    filealloc(void);
@@ -33,13 +41,17 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+extern int      readahead;
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
+int             dirempty(struct inode*);
+uint            dirskip(struct inode*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+struct page*    igetpage(struct inode*, uint);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -50,6 +62,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            iprefetch(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 
@@ -61,15 +74,41 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void*           kallocmega(void);
+void            kfreemega(void *);
 void            kinit();
+uint64          kfreepages(void);
+void            krefinc(void *);
+int             krefcnt(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(int);
+void            begin_opn(int, int);
 void            end_op(int);
+void            log_sync(int);
 void            crash_op(int,int);
 
+// mmap.c
+uint64          mmap(uint64, int, int, struct file*, uint);
+int             mmapfault(struct proc*, uint64, int);
+int             munmap(uint64, uint64);
+void            mmapfree(struct proc*);
+int             mmapcopy(struct proc*, struct proc*);
+uint64          mmapbase(struct proc*);
+
+// pcache.c
+void            pcinit(void);
+struct page*    pcget(uint, uint, uint);
+int             pccached(uint, uint, uint);
+struct page*    pcadd(uint, uint, uint, char*);
+void            pcput(struct page*);
+void            pcwrite(uint, uint, uint, char*, uint);
+void            pcinval(uint, uint);
+int             pcshrink(int);
+int             pcpages(void);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -89,14 +128,23 @@ int             growproc(int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+int             kthread(void (*)(void*), void*, char*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
+uint64          procasid(struct proc*);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             schedintr(int);
+void            schedboost(void);
+int             setnice(int, int);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+void            sleeptimeout(void*, struct spinlock*, uint);
+void            sleepuntil(void*, struct spinlock*, uint64);
+void            timerexpire(uint);
+uint64          clockexpire(uint64);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
@@ -111,6 +159,7 @@ void            swtch(struct context*, struct context*);
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
+int             holdingspin(void);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
@@ -132,6 +181,13 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(void);
+int             swappages(void);
+void            swapfree(uint64, int);
+void            swapread(uint64, char*);
+void*           swapkalloc(void);
+
 // syscall.c
 int             argint(int, int*);
 int             argstr(int, char*, int);
@@ -145,6 +201,8 @@ extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
+uint64          clocknow(void);
+void            clockarm(uint64);
 void            usertrapret(void);
 
 // uart.c
@@ -153,9 +211,15 @@ void            uartintr(void);
 void            uartputc(int);
 int             uartgetc(void);
 
+// ucopy.S
+int             ucopy(char*, char*, uint64);
+int             ucopystr(char*, char*, uint64);
+
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+pagetable_t     kvmcreate(pagetable_t);
+void            kvmsetuser(pagetable_t, pagetable_t);
 uint64          kvmpa(uint64);
 void            kvmmap(uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
@@ -163,10 +227,18 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmswapinall(pagetable_t, uint64);
+void            uvmprefault(uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+int             vmfault(struct proc*, uint64, int);
+int             tlbstale(struct proc*, uint64, uint64);
+void            uvmflush(pagetable_t, uint64, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -181,6 +253,9 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(int);
 void            virtio_disk_rw(int, struct buf *, int);
+void            virtio_disk_start(int, struct buf **, int, int);
+void            virtio_disk_kick(int);
+void            virtio_disk_wait(int, struct buf *);
 void            virtio_disk_intr(int);
 
 // number of elements in fixed-size array
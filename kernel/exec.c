@@ -6,6 +6,10 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "page.h"
 
 static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
 
@@ -13,11 +17,12 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg;
   uint64 argc, sz, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct seg seg[NSEG];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -38,8 +43,11 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record where the program's segments are in the file,
+  // for execfault() to page them in on demand. Only if
+  // there are too many are they loaded into memory now.
   sz = 0;
+  nseg = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -47,17 +55,38 @@ exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz > MMAPTOP)
       goto bad;
-    if((sz = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      goto bad;
+    if(ph.vaddr % PGSIZE != 0 || ph.vaddr < PGROUNDUP(sz))
       goto bad;
-    if(ph.vaddr % PGSIZE != 0)
+    if(nseg < NSEG){
+      seg[nseg].va = ph.vaddr;
+      seg[nseg].memsz = ph.memsz;
+      seg[nseg].off = ph.off;
+      seg[nseg].filesz = ph.filesz;
+      seg[nseg].flags = ph.flags;
+      nseg++;
+      sz = ph.vaddr + ph.memsz;
+      continue;
+    }
+    if((sz = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
       goto bad;
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
-  iunlockput(ip);
+  // keep a reference to the file for execfault(). it
+  // shares the file's cached pages, so while the program
+  // runs, ip->ntext keeps the file from being written;
+  // and a file mapped writable and shared can't be run.
+  // ntext is raised under ip's lock, and dropped without.
+  if(ip->nwmap > 0)
+    goto bad;
+  __sync_fetch_and_add(&ip->ntext, 1);
+  iunlock(ip);
   end_op(ROOTDEV);
+  exe = ip;
   ip = 0;
 
   p = myproc();
@@ -106,12 +135,25 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  mmapfree(p);
   oldpagetable = p->pagetable;
+  oldexe = p->exe;
   p->pagetable = pagetable;
+  kvmsetuser(p->kpagetable, pagetable);
+  p->asid = 0;  // the TLB may hold entries from the old page table
   p->sz = sz;
+  p->exe = exe;
+  memmove(p->seg, seg, sizeof(seg));
+  p->nseg = nseg;
   p->tf->epc = elf.entry;  // initial program counter = main
   p->tf->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    __sync_fetch_and_sub(&oldexe->ntext, 1);
+    begin_op(ROOTDEV);
+    iput(oldexe);
+    end_op(ROOTDEV);
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -122,6 +164,12 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op(ROOTDEV);
   }
+  if(exe){
+    __sync_fetch_and_sub(&exe->ntext, 1);
+    begin_op(ROOTDEV);
+    iput(exe);
+    end_op(ROOTDEV);
+  }
   return -1;
 }
 
@@ -152,3 +200,78 @@ loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz
   
   return 0;
 }
+
+// Page in the page at va of the program p is running, for
+// vmfault(). A page wholly inside the file image of a segment
+// is mapped from the page cache: shared if the segment is
+// read-only, and copy-on-write if it is writable. Other pages
+// of a segment get a page of their own, holding the file's
+// bytes and zeroes for the bss.
+// Returns 0 on success, -1 on failure, or 1 if va is not
+// in any of p's segments.
+int
+execfault(struct proc *p, uint64 va, int write)
+{
+  struct seg *s;
+  struct page *pg;
+  char *mem;
+  uint n;
+  int perm, locked;
+
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    if(va >= s->va && va < s->va + s->memsz)
+      break;
+  if(s == &p->seg[p->nseg])
+    return 1;
+
+  if(s->flags & ELF_PROG_FLAG_WRITE){
+    perm = PTE_W|PTE_X|PTE_R|PTE_U;
+  } else {
+    perm = PTE_U;
+    if(s->flags & ELF_PROG_FLAG_READ)
+      perm |= PTE_R;
+    if(s->flags & ELF_PROG_FLAG_EXEC)
+      perm |= PTE_X;
+  }
+
+  // as in mmapfault(), no other inode's lock is held here,
+  // but a fault in copyout() may come from a read() of the
+  // program's file itself, which already holds its lock.
+  locked = holdingsleep(&p->exe->lock);
+  if(!locked)
+    ilock(p->exe);
+  pg = 0;
+  if(s->off % PGSIZE == 0 && va + PGSIZE <= s->va + s->filesz)
+    pg = igetpage(p->exe, (s->off + (va - s->va)) / PGSIZE);
+  if(pg){
+    mem = pg->data;
+    krefinc(mem);
+    pcput(pg);
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+  } else if((mem = kalloc()) != 0){
+    memset(mem, 0, PGSIZE);
+    if(va < s->va + s->filesz){
+      n = s->va + s->filesz - va;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      if(readi(p->exe, 0, (uint64)mem, s->off + (va - s->va), n) != n){
+        kfree(mem);
+        mem = 0;
+      }
+    }
+  }
+  if(!locked)
+    iunlock(p->exe);
+  if(mem == 0)
+    return -1;
+
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  // a data page written right away gets its copy now.
+  if(write && (perm & PTE_COW))
+    return uvmcow(p->pagetable, va);
+  return 0;
+}
@@ -19,6 +19,10 @@ struct {
   struct file file[NFILE];
 } ftable;
 
+#define RAINIT 4  // first read-ahead window, in blocks
+
+int readahead = RAWINDOW;  // largest read-ahead window; see sys_readahead()
+
 void
 fileinit(void)
 {
@@ -101,6 +105,45 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Called before reading n bytes at f->off. If f is being read
+// sequentially, start reading the blocks after the ones the read
+// wants, so that they are in the cache by the time it gets there.
+// The window of blocks to keep in flight doubles with each
+// sequential read, up to readahead; a read elsewhere closes it.
+// Caller must hold f->ip->lock.
+static void
+fileahead(struct file *f, int n)
+{
+  uint last, end, cnt;
+
+  if(n <= 0 || f->off != f->ranext || readahead <= 0){
+    f->rawin = 0;
+    f->raend = 0;
+    return;
+  }
+
+  if(f->rawin == 0)
+    f->rawin = RAINIT;
+  else
+    f->rawin *= 2;
+  if(f->rawin > readahead)
+    f->rawin = readahead;
+
+  // don't bother until less than half a window is left.
+  last = (f->off + n - 1) / BSIZE;
+  if(f->raend > last + f->rawin/2)
+    return;
+
+  if(f->raend < f->off / BSIZE)
+    f->raend = f->off / BSIZE;
+  end = last + 1 + f->rawin;
+  cnt = end - f->raend;
+  if(cnt > RAMAX)
+    cnt = RAMAX;
+  iprefetch(f->ip, f->raend, cnt);
+  f->raend += cnt;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -118,9 +161,15 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(f, 1, addr, n);
   } else if(f->type == FD_INODE){
+    // not under the inode's lock; see uvmprefault().
+    uvmprefault(addr, n, 1);
     ilock(f->ip);
+    if(f->ip->type == T_DIR)
+      f->off = dirskip(f->ip, f->off);
+    fileahead(f, n);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
+    f->ranext = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -159,6 +208,7 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      uvmprefault(addr + i, n1, 0);
       begin_op(f->ip->dev);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE and FD_DEVICE
+  uint ranext;       // FD_INODE: offset a sequential read would start at
+  uint rawin;        // FD_INODE: read-ahead window, in blocks
+  uint raend;        // FD_INODE: first block not yet read ahead
   short major;       // FD_DEVICE
   short minor;       // FD_DEVICE
 };
@@ -14,11 +17,15 @@ struct file {
 #define minor(dev)  ((dev) & 0xFFFF)
 #define	mkdev(m,n)  ((uint)((m)<<16| (n)))
 
+#define NMAP 32  // indirect block entries cached in an inode
+
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int ntext;          // Processes running it; see exec.c
+  int nwmap;          // Writable MAP_SHARED regions of it; see mmap.c
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,7 +34,11 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+
+  uint mapstart;      // map[i] is the address of block mapstart+i,
+  uint mapn;          // for i < mapn; a copy of part of
+  uint map[NMAP];     // an indirect block, to save bread()s
 };
 
 // map major device number to device functions.
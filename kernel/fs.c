@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "page.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
@@ -307,6 +308,7 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->mapn = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -371,40 +373,184 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The NDINDIRECT blocks
+// after that are listed in the NINDIRECT indirect blocks that
+// are themselves listed in block ip->addrs[NDIRECT+1].
+//
+// The inode keeps a copy of the NMAP entries of an indirect
+// block starting at the one bmap() last looked up there,
+// so that sequential I/O need not read the indirect block
+// again for each block.
+
+// Return the address in indirect block ind of file block bn,
+// which is entry i there. If there is no such block, allocate
+// one if alloc is set, or else return 0. Remember the entries
+// from i on in ip's mapping cache.
+static uint
+bmapind(struct inode *ip, uint ind, uint i, uint bn, int alloc)
+{
+  uint addr, *a, n;
+  struct buf *bp;
+
+  bp = bread(ip->dev, ind);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0 && alloc){
+    a[i] = addr = balloc(ip->dev);
+    log_write(bp);
+  }
+  n = NINDIRECT - i;
+  if(n > NMAP)
+    n = NMAP;
+  memmove(ip->map, a + i, n * sizeof(uint));
+  ip->mapstart = bn;
+  ip->mapn = n;
+  brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one if alloc is
+// set, and otherwise returns 0. Only directories have such
+// holes inside the file; see dirlink().
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, int alloc)
 {
   uint addr, *a;
   struct buf *bp;
+  uint fbn = bn;
 
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
+    if((addr = ip->addrs[bn]) == 0 && alloc)
       ip->addrs[bn] = addr = balloc(ip->dev);
     return addr;
   }
+
+  if(bn - ip->mapstart < ip->mapn && (addr = ip->map[bn - ip->mapstart]) != 0)
+    return addr;
+
   bn -= NDIRECT;
 
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
+    if((addr = ip->addrs[NDIRECT]) == 0){
+      if(!alloc)
+        return 0;
       ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+    }
+    return bmapind(ip, addr, bn, fbn, alloc);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // Load doubly-indirect block, and then the
+    // indirect block it points to, allocating if necessary.
+    if((addr = ip->addrs[NDIRECT+1]) == 0){
+      if(!alloc)
+        return 0;
+      ip->addrs[NDIRECT+1] = addr = balloc(ip->dev);
+    }
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+    if((addr = a[bn / NINDIRECT]) == 0 && alloc){
+      a[bn / NINDIRECT] = addr = balloc(ip->dev);
       log_write(bp);
     }
     brelse(bp);
-    return addr;
+    if(addr == 0)
+      return 0;
+    return bmapind(ip, addr, bn % NINDIRECT, fbn, alloc);
   }
 
   panic("bmap: out of range");
 }
 
+// Return the first block of ip from bn on that is allocated,
+// or one past the last block if none is. Skips the range of
+// an unallocated indirect block whole, and reads each
+// indirect block once for all the holes it lists, so that
+// walking a hashed directory costs little more than the
+// blocks it has.
+static uint
+bnext(struct inode *ip, uint bn)
+{
+  uint nb, i, addr, *a;
+  struct buf *bp;
+
+  nb = (ip->size + BSIZE - 1) / BSIZE;
+  for(; bn < NDIRECT && bn < nb; bn++)
+    if(ip->addrs[bn])
+      return bn;
+
+  while(bn < nb){
+    // the indirect block listing bn, and bn's entry in it.
+    if(bn < NDIRECT + NINDIRECT){
+      addr = ip->addrs[NDIRECT];
+      i = bn - NDIRECT;
+    } else {
+      if(ip->addrs[NDIRECT+1] == 0)
+        break;
+      bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
+      addr = ((uint*)bp->data)[(bn - NDIRECT - NINDIRECT) / NINDIRECT];
+      brelse(bp);
+      i = (bn - NDIRECT - NINDIRECT) % NINDIRECT;
+    }
+    if(addr){
+      bp = bread(ip->dev, addr);
+      a = (uint*)bp->data;
+      for(; i < NINDIRECT && bn < nb; i++, bn++){
+        if(a[i]){
+          brelse(bp);
+          return bn;
+        }
+      }
+      brelse(bp);
+    } else {
+      bn += NINDIRECT - i;
+    }
+  }
+  return nb;
+}
+
+// Start reading blocks bn..bn+n-1 of ip into the buffer cache,
+// without waiting for them, stopping at the end of the file.
+// Caller must hold ip->lock.
+void
+iprefetch(struct inode *ip, uint bn, uint n)
+{
+  uint blocks[RAMAX], nb, i, k;
+
+  nb = (ip->size + BSIZE - 1) / BSIZE;
+  if(n > RAMAX)
+    n = RAMAX;
+  for(i = 0, k = 0; i < n && bn + i < nb; i++){
+    // blocks of cached pages won't be read.
+    if(ip->type == T_FILE && pccached(ip->dev, ip->inum, (bn + i) / (PGSIZE/BSIZE)))
+      continue;
+    if((blocks[k] = bmap(ip, bn + i, 0)) != 0)
+      k++;
+  }
+  if(k > 0)
+    breadahead(ip->dev, blocks, k);
+}
+
+// Free indirect block ind of ip and the blocks it lists.
+static void
+itruncind(struct inode *ip, uint ind)
+{
+  int j;
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(ip->dev, ind);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j])
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, ind);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -417,6 +563,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcinval(ip->dev, ip->inum);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -425,17 +573,23 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    itruncind(ip, ip->addrs[NDIRECT]);
+    ip->addrs[NDIRECT] = 0;
+  }
+
+  if(ip->addrs[NDIRECT+1]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
     a = (uint*)bp->data;
     for(j = 0; j < NINDIRECT; j++){
       if(a[j])
-        bfree(ip->dev, a[j]);
+        itruncind(ip, a[j]);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    bfree(ip->dev, ip->addrs[NDIRECT+1]);
+    ip->addrs[NDIRECT+1] = 0;
   }
 
+  ip->mapn = 0;
   ip->size = 0;
   iupdate(ip);
 }
@@ -452,15 +606,53 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Return page pgno of regular file ip from the page
+// cache, with a reference taken, reading it in first
+// if it isn't cached. Returns 0 if it can't be cached.
+// Caller must hold ip->lock.
+struct page*
+igetpage(struct inode *ip, uint pgno)
+{
+  struct page *pg;
+  struct buf *bp;
+  char *mem;
+  uint bn, addr, i;
+
+  if((pg = pcget(ip->dev, ip->inum, pgno)) != 0)
+    return pg;
+  if((mem = kalloc()) == 0)
+    return 0;
+
+  bn = pgno * (PGSIZE/BSIZE);
+  iprefetch(ip, bn, PGSIZE/BSIZE);
+  for(i = 0; i < PGSIZE/BSIZE; i++){
+    if(bn + i >= MAXFILE || (addr = bmap(ip, bn + i, 0)) == 0){
+      memset(mem + i*BSIZE, 0, BSIZE);
+      continue;
+    }
+    bp = bread(ip->dev, addr);
+    memmove(mem + i*BSIZE, bp->data, BSIZE);
+    brelse(bp);
+  }
+
+  if((pg = pcadd(ip->dev, ip->inum, pgno, mem)) == 0)
+    kfree(mem);
+  return pg;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// Regular files are read through the page cache.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  static char zeroes[BSIZE];
+  uint tot, m, addr;
   struct buf *bp;
+  struct page *pg;
+  int r;
 
   if(off > ip->size || off + n < off)
     return -1;
@@ -468,8 +660,22 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if(ip->type == T_FILE && (pg = igetpage(ip, off/PGSIZE)) != 0){
+      m = min(n - tot, PGSIZE - off%PGSIZE);
+      r = either_copyout(user_dst, dst, pg->data + off%PGSIZE, m);
+      pcput(pg);
+      if(r == -1)
+        break;
+      continue;
+    }
     m = min(n - tot, BSIZE - off%BSIZE);
+    if((addr = bmap(ip, off/BSIZE, 0)) == 0){
+      // a hole in a directory reads as zeroes.
+      if(either_copyout(user_dst, dst, zeroes, m) == -1)
+        break;
+      continue;
+    }
+    bp = bread(ip->dev, addr);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
       break;
@@ -483,25 +689,32 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
 // otherwise, src is a kernel address.
+// Cached pages of regular files are updated too,
+// so a file that is some process's running program,
+// whose pages it may share, can't be written.
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
 
+  if(ip->type == T_FILE && ip->ntext > 0)
+    return -1;
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bp = bread(ip->dev, bmap(ip, off/BSIZE, 1));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
     }
     log_write(bp);
+    if(ip->type == T_FILE)
+      pcwrite(ip->dev, ip->inum, off, (char*)bp->data + off%BSIZE, m);
     brelse(bp);
   }
 
@@ -525,40 +738,122 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// A directory starts out as a list of entries in its first
+// block. Once that block is full, each further entry goes in
+// one of NDIRBUCKET blocks, chosen by hashing its name, or if
+// that block is full, in one of the next DIRPROBE-1 blocks.
+// Entry 0 of a bucket block is a header that says whether an
+// entry that hashed there has spilled into a later block.
+// Bucket blocks are only allocated when something is put in
+// them, and the directory's size runs to the end of the last
+// one, so a directory is hashed if it is bigger than a block.
+// The holes in between read as zeroes, but read() skips them;
+// see dirskip().
+// Looking up, adding or removing a name reads the first
+// block and one bucket block, or a few if some have spilled.
+
+#define DPB (BSIZE / sizeof(struct dirent))  // entries per block
+
+static uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 0;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return h % NDIRBUCKET;
+}
+
+// Look for name among entries first..last-1 of block bn of
+// directory dp; a name of 0 matches any entry. If found, set *poff to its byte offset and
+// return its inode number. If not, return 0; then, if empty is
+// not 0 and there was a free entry, set *empty to its offset.
+// If spill is not 0, set *spill from the block's header.
+static uint
+dirscan(struct inode *dp, uint bn, int first, int last, char *name,
+        uint *poff, uint *empty, int *spill)
+{
+  uint addr, inum;
+  struct buf *bp;
+  struct dirent *de;
+  int i;
+
+  if(spill)
+    *spill = 0;
+  if((addr = bmap(dp, bn, 0)) == 0){
+    // not allocated yet, so all free.
+    if(empty)
+      *empty = bn*BSIZE + first*sizeof(struct dirent);
+    return 0;
+  }
+
+  bp = bread(dp->dev, addr);
+  de = (struct dirent*)bp->data;
+  if(spill)
+    *spill = de[0].name[0];
+  inum = 0;
+  for(i = last-1; i >= first; i--){
+    if(de[i].inum == 0){
+      if(empty)
+        *empty = bn*BSIZE + i*sizeof(struct dirent);
+      continue;
+    }
+    if(name == 0 || namecmp(name, de[i].name) == 0){
+      // entry matches path element
+      if(poff)
+        *poff = bn*BSIZE + i*sizeof(struct dirent);
+      inum = de[i].inum;
+      break;
+    }
+  }
+  brelse(bp);
+  return inum;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint inum, h;
+  int p, spill;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
+  if((inum = dirscan(dp, 0, 0, min(dp->size, BSIZE) / sizeof(struct dirent),
+                     name, poff, 0, 0)) != 0)
+    return iget(dp->dev, inum);
+
+  if(dp->size <= BSIZE)
+    return 0;
+  h = dirhash(name);
+  for(p = 0; p < DIRPROBE; p++){
+    inum = dirscan(dp, 1 + (h+p) % NDIRBUCKET, 1, DPB, name, poff, 0, &spill);
+    if(inum != 0)
       return iget(dp->dev, inum);
-    }
+    if(!spill)
+      break;
   }
 
   return 0;
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
+// Returns -1 if name is present or there is no room for it.
+// Besides the entry's block and dp's inode, this may write
+// the spill flags of DIRPROBE-1 buckets, and a new bucket's
+// indirect blocks and their bitmap blocks, so the caller
+// must have reserved DIROPBLOCKS of log with begin_opn().
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  uint off, h, bn;
+  int p, spill;
   struct dirent de;
+  struct buf *bp;
   struct inode *ip;
 
   // Check that name is not present.
@@ -567,12 +862,33 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  // Look for an empty dirent in the first block.
+  off = min(dp->size, BSIZE);
+  dirscan(dp, 0, 0, off / sizeof(struct dirent), "", 0, &off, 0);
+
+  if(off >= BSIZE){
+    // the first block is full; hash.
+    h = dirhash(name);
+    for(p = 0; p < DIRPROBE; p++){
+      bn = 1 + (h+p) % NDIRBUCKET;
+      off = 0;
+      dirscan(dp, bn, 1, DPB, "", 0, &off, &spill);
+      if(off != 0)
+        break;
+      if(!spill){
+        // tell lookups to keep looking past this block.
+        bp = bread(dp->dev, bmap(dp, bn, 0));
+        ((struct dirent*)bp->data)[0].name[0] = 1;
+        log_write(bp);
+        brelse(bp);
+      }
+    }
+    if(p == DIRPROBE)
+      return -1;
+    // a bucket past the end makes the directory longer;
+    // writei() writes dp's inode.
+    if(dp->size < off - off%BSIZE + BSIZE)
+      dp->size = off - off%BSIZE + BSIZE;
   }
 
   strncpy(de.name, name, DIRSIZ);
@@ -583,6 +899,46 @@ dirlink(struct inode *dp, char *name, uint inum)
   return 0;
 }
 
+// Is the directory dp empty except for "." and ".." ?
+int
+dirempty(struct inode *dp)
+{
+  uint bn, nb;
+  int first, last;
+
+  nb = (dp->size + BSIZE - 1) / BSIZE;
+  for(bn = bnext(dp, 0); bn < nb; bn = bnext(dp, bn+1)){
+    if(bn == 0){
+      first = 2;
+      last = min(dp->size, BSIZE) / sizeof(struct dirent);
+    } else {
+      first = 1;
+      last = DPB;
+    }
+    if(dirscan(dp, bn, first, last, 0, 0, 0, 0) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+// Return where a read() of directory dp at off should start:
+// off itself, unless off is in a hole, and then the start of
+// the next block that isn't, or the end of dp. So listing a
+// hashed directory reads its entries rather than a block of
+// empty ones for each hole.
+uint
+dirskip(struct inode *dp, uint off)
+{
+  uint bn;
+
+  if(off >= dp->size)
+    return off;
+  bn = bnext(dp, off / BSIZE);
+  if(bn == off / BSIZE)
+    return off;
+  return min(bn * BSIZE, dp->size);
+}
+
 // Paths
 
 // Copy the next path element from path into name.
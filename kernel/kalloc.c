@@ -1,6 +1,27 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// and 2-megabyte megapages for large user allocations.
+//
+// Each CPU keeps its own free list, so that the common
+// kalloc()/kfree() path only takes that CPU's lock. A CPU
+// whose list runs dry refills a batch of pages from a global
+// pool, or, if the pool is empty too, steals half of the
+// pages of a sibling CPU, or, failing that, breaks up a
+// free megapage. A CPU whose list grows too long drains a
+// batch back to the pool.
+//
+// Free megapages are kept whole on a list of their own,
+// which freerange() fills with the aligned 2-megabyte
+// stretches of memory. Pages are never put back together
+// into megapages, so kallocmega() only succeeds while
+// memory is not yet broken up.
+//
+// Each page also has a reference count, so that fork() can
+// share pages copy-on-write. kalloc() sets it to 1, krefinc()
+// adds a reference, and kfree() only puts the page back on a
+// free list when the last reference goes away. The counts are
+// updated with atomic instructions rather than under a lock.
 
 #include "types.h"
 #include "param.h"
@@ -14,19 +35,47 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define KBATCH  32          // pages moved between a CPU and the pool at once
+#define KHIGH   (4*KBATCH)  // drain to the pool above this many pages
+
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+// reference counts, one per physical page.
+static int kref[(PHYSTOP - KERNBASE) / PGSIZE];
+
 struct run {
   struct run *next;
 };
 
+// per-CPU free lists.
+// the lock names must start with "kmem" for kalloctest's statistics.
+struct kmem {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+} kmem[NCPU];
+
+// global pool shared by all CPUs.
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int nfree;
+} kpool;
+
+// free megapages.
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+} kmega;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&kpool.lock, "kmem_pool");
+  initlock(&kmega.lock, "kmem_mega");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,48 +84,320 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kref[PA2REF(p)] = 1;
+    if((uint64)p % MEGAPGSIZE == 0 && p + MEGAPGSIZE <= (char*)pa_end){
+      kfreemega(p);
+      p += MEGAPGSIZE - PGSIZE;
+    } else {
+      kfree(p);
+    }
+  }
+}
+
+// Detach up to n pages from the front of *list.
+// Returns the detached chain; *cnt is set to its length.
+static struct run*
+takerun(struct run **list, int n, int *cnt)
+{
+  struct run *head, *r;
+  int i;
+
+  head = *list;
+  if(head == 0){
+    *cnt = 0;
+    return 0;
+  }
+  r = head;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  *list = r->next;
+  r->next = 0;
+  *cnt = i;
+  return head;
+}
+
+// Prepend a chain of pages to *list.
+static void
+putrun(struct run **list, struct run *head)
+{
+  struct run *r;
+
+  if(head == 0)
+    return;
+  for(r = head; r->next; r = r->next)
+    ;
+  r->next = *list;
+  *list = head;
+}
+
+// Break a free megapage up into pages for the pool.
+// Returns 0 if there is none.
+static int
+msplit(void)
+{
+  struct run *r, *chain;
+  char *base;
+  int i;
+
+  acquire(&kmega.lock);
+  r = kmega.freelist;
+  if(r){
+    kmega.freelist = r->next;
+    kmega.nfree--;
+  }
+  release(&kmega.lock);
+  if(r == 0)
+    return 0;
+
+  base = (char*)r;
+  chain = 0;
+  for(i = MEGAPGSIZE/PGSIZE - 1; i >= 0; i--){
+    r = (struct run*)(base + i*PGSIZE);
+    r->next = chain;
+    chain = r;
+  }
+
+  acquire(&kpool.lock);
+  putrun(&kpool.freelist, chain);
+  kpool.nfree += MEGAPGSIZE/PGSIZE;
+  release(&kpool.lock);
+  return 1;
+}
+
+// Move a batch of pages into CPU id's empty list,
+// from the pool if it has any, otherwise from the
+// sibling CPU with the most free pages, otherwise
+// from a megapage broken up into the pool.
+// Called with interrupts off and no kmem locks held.
+static void
+refill(int id)
+{
+  struct run *chain;
+  int i, n, victim, most;
+
+  acquire(&kpool.lock);
+  chain = takerun(&kpool.freelist, KBATCH, &n);
+  kpool.nfree -= n;
+  release(&kpool.lock);
+
+  if(chain == 0){
+    // steal half of the largest sibling list.
+    // nfree is read without the lock; it is only a hint.
+    victim = -1;
+    most = 0;
+    for(i = 0; i < NCPU; i++){
+      if(i != id && kmem[i].nfree > most){
+        most = kmem[i].nfree;
+        victim = i;
+      }
+    }
+    if(victim >= 0){
+      acquire(&kmem[victim].lock);
+      chain = takerun(&kmem[victim].freelist, (kmem[victim].nfree + 1) / 2, &n);
+      kmem[victim].nfree -= n;
+      release(&kmem[victim].lock);
+    }
+  }
+
+  if(chain == 0){
+    if(msplit() == 0)
+      return;
+    acquire(&kpool.lock);
+    chain = takerun(&kpool.freelist, KBATCH, &n);
+    kpool.nfree -= n;
+    release(&kpool.lock);
+    if(chain == 0)
+      return;
+  }
+
+  acquire(&kmem[id].lock);
+  putrun(&kmem[id].freelist, chain);
+  kmem[id].nfree += n;
+  release(&kmem[id].lock);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference is dropped.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *chain;
+  int id, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(n < 0)
+    panic("kfree: refcount");
+  if(n > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  kmem[id].nfree++;
+  chain = 0;
+  if(kmem[id].nfree > KHIGH){
+    chain = takerun(&kmem[id].freelist, KBATCH, &n);
+    kmem[id].nfree -= n;
+  }
+  release(&kmem[id].lock);
+
+  if(chain){
+    acquire(&kpool.lock);
+    putrun(&kpool.freelist, chain);
+    kpool.nfree += n;
+    release(&kpool.lock);
+  }
+  pop_off();
+}
+
+// Take a page from this CPU's free list, refilling it
+// from the pool or a sibling if it is empty.
+static struct run*
+kgrab(void)
+{
+  struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  if(r == 0){
+    release(&kmem[id].lock);
+    refill(id);
+    acquire(&kmem[id].lock);
+    r = kmem[id].freelist;
+  }
+  if(r){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+  }
+  release(&kmem[id].lock);
+  pop_off();
+
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// When memory runs out, asks the buffer cache and
+// the page cache to give back some of their pages
+// before giving up.
 void *
 kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  r = kgrab();
+  if(r == 0 && bshrink(KBATCH) + pcshrink(KBATCH) > 0)
+    r = kgrab();
 
-  if(r)
+  if(r){
+    kref[PA2REF(r)] = 1;
     memset((char*)r, 5, PGSIZE); // fill with junk
+  }
+  return (void*)r;
+}
+
+// Allocate one 2-megabyte megapage, aligned to its size.
+// Returns 0 if there is no free megapage. Each of its
+// pages gets a reference count of 1, so that the megapage
+// can later be split into pages that are freed one by one;
+// until then, its first page's count stands for all of it.
+// Unlike kalloc(), doesn't fill it with junk: the caller
+// fills it anyway.
+void *
+kallocmega(void)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmega.lock);
+  r = kmega.freelist;
+  if(r){
+    kmega.freelist = r->next;
+    kmega.nfree--;
+  }
+  release(&kmega.lock);
+
+  if(r){
+    for(i = 0; i < MEGAPGSIZE/PGSIZE; i++)
+      kref[PA2REF(r) + i] = 1;
+  }
   return (void*)r;
 }
+
+// Drop a reference to a megapage returned by kallocmega(),
+// freeing it when the last one goes away.
+void
+kfreemega(void *pa)
+{
+  struct run *r;
+  int i, n;
+
+  if(((uint64)pa % MEGAPGSIZE) != 0 || (char*)pa < end || (uint64)pa + MEGAPGSIZE > PHYSTOP)
+    panic("kfreemega");
+
+  n = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(n < 0)
+    panic("kfreemega: refcount");
+  if(n > 0)
+    return;
+  for(i = 1; i < MEGAPGSIZE/PGSIZE; i++)
+    kref[PA2REF(pa) + i] = 0;
+
+  r = (struct run*)pa;
+  acquire(&kmega.lock);
+  r->next = kmega.freelist;
+  kmega.freelist = r;
+  kmega.nfree++;
+  release(&kmega.lock);
+}
+
+// Add a reference to an allocated page.
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(&kref[PA2REF(pa)], 1) < 1)
+    panic("krefinc: free page");
+}
+
+// Return the number of references to an allocated page.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&kref[PA2REF(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Return the number of free pages.
+// The per-CPU counts are read without locks,
+// so the result is only an estimate.
+uint64
+kfreepages(void)
+{
+  uint64 n;
+
+  n = kpool.nfree + (uint64)kmega.nfree * (MEGAPGSIZE/PGSIZE);
+  for(int i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  return n;
+}
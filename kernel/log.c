@@ -4,6 +4,7 @@
 #include "param.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "proc.h"
 #include "fs.h"
 #include "buf.h"
 
@@ -16,10 +17,28 @@
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. Usually begin_op() just reserves log
+// space for MAXOPBLOCKS blocks and returns; one that adds a
+// directory entry calls begin_opn() to reserve DIROPBLOCKS
+// instead, since dirlink() may write more. But if it thinks
+// the log is close to running out, it sleeps until the log
+// has been installed. As the system call logs blocks, they
+// are taken out of its reservation, so a block is never
+// counted twice; end_op() gives back whatever is left.
+//
+// Commits are done by a per-device committer kernel thread,
+// so end_op() never waits for the disk. Once the last
+// outstanding end_op() has returned, the committer gives
+// processes about to start FS system calls a chance to
+// join the transaction, and then commits all of them with
+// one set of disk writes. log_sync() waits until everything
+// done so far is on disk.
+//
+// A committed transaction stays in the log, and its blocks
+// stay pinned in the buffer cache, until the log is nearly
+// full. Only then are the blocks installed at their home
+// locations, each block once, however many transactions
+// logged it.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,7 +47,14 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// The header's block list holds the transactions in the order
+// they committed, and a block may appear more than once.
+// mkfs chooses the size of the log.
+// Log appends are synchronous, but the blocks of a
+// transaction go to the disk LOGBATCH at a time.
+
+#define LOGBATCH  16  // blocks handed to the disk at once
+#define CKPTSLACK (4*MAXOPBLOCKS)  // install when less room than this is left
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,7 +68,10 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
+  int reserved;    // log blocks reserved by outstanding FS sys calls.
   int committing;  // in commit(), please wait.
+  int ncommit;     // how many transactions have committed.
+  int committed;   // lh.block[0..committed-1] are committed.
   int dev;
   struct logheader lh;
 };
@@ -50,35 +79,74 @@ struct log log[NDISK];
 
 static void recover_from_log(int);
 static void commit(int);
+static void committer(void*);
 
 void
 initlog(int dev, struct superblock *sb)
 {
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
+  if (sb->nlog - 1 > LOGSIZE || sb->nlog - 1 < DIROPBLOCKS)
+    panic("initlog: bad log size");
 
   initlock(&log[dev].lock, "log");
   log[dev].start = sb->logstart;
   log[dev].size = sb->nlog;
   log[dev].dev = dev;
   recover_from_log(dev);
+
+  if(kthread(committer, (void*)(uint64)dev, "committer") < 0)
+    panic("initlog: committer");
 }
 
-// Copy committed blocks from log to their home location
+// Write a batch of n home blocks to disk, and release them.
 static void
-install_trans(int dev)
+install_batch(struct buf **dbuf, int n, int recovering)
 {
-  int tail;
+  int i;
 
+  bstart(dbuf, n, 1);  // write dst to disk
+  for (i = 0; i < n; i++) {
+    bwait(dbuf[i]);
+    if(recovering == 0)
+      bunpin(dbuf[i]);
+    brelse(dbuf[i]);
+  }
+}
+
+// Copy committed blocks from log to their home location.
+// A block logged by more than one transaction is only
+// installed once, from its last copy. Outside of recovery
+// the cache holds that copy, and each block has been
+// pinned there once, by log_write().
+static void
+install_trans(int dev, int recovering)
+{
+  struct buf *dbuf[LOGBATCH];
+  int tail, j, n;
+
+  n = 0;
   for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *lbuf = bread(dev, log[dev].start+tail+1); // read log block
-    struct buf *dbuf = bread(dev, log[dev].lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+    // skip a block that a later transaction logged again.
+    for (j = tail+1; j < log[dev].lh.n; j++)
+      if (log[dev].lh.block[j] == log[dev].lh.block[tail])
+        break;
+    if (j < log[dev].lh.n)
+      continue;
+
+    dbuf[n] = bread(dev, log[dev].lh.block[tail]); // read dst
+    if (recovering) {
+      struct buf *lbuf = bread(dev, log[dev].start+tail+1); // read log block
+      memmove(dbuf[n]->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+    }
+    if (++n == LOGBATCH) {
+      install_batch(dbuf, n, recovering);
+      n = 0;
+    }
   }
+  if (n > 0)
+    install_batch(dbuf, n, recovering);
 }
 
 // Read the log header from disk into the in-memory log header
@@ -116,24 +184,37 @@ static void
 recover_from_log(int dev)
 {
   read_head(dev);
-  install_trans(dev); // if committed, copy from log to disk
+  install_trans(dev, 1); // if committed, copy from log to disk
   log[dev].lh.n = 0;
+  log[dev].committed = 0;
   write_head(dev); // clear the log
 }
 
 // called at the start of each FS system call.
 void
 begin_op(int dev)
+{
+  begin_opn(dev, MAXOPBLOCKS);
+}
+
+// called at the start of an FS system call that
+// may write up to n blocks, rather than MAXOPBLOCKS.
+void
+begin_opn(int dev, int n)
 {
   acquire(&log[dev].lock);
   while(1){
     if(log[dev].committing){
       sleep(&log, &log[dev].lock);
-    } else if(log[dev].lh.n + (log[dev].outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log[dev].lh.n + log[dev].reserved + n > log[dev].size - 1){
+      // this op might exhaust log space; wait for the log
+      // to be committed and installed.
+      wakeup(&log[dev].lh);
       sleep(&log, &log[dev].lock);
     } else {
       log[dev].outstanding += 1;
+      log[dev].reserved += n;
+      myproc()->logcredit = n;
       release(&log[dev].lock);
       break;
     }
@@ -141,63 +222,120 @@ begin_op(int dev)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// if this was the last outstanding operation, lets the
+// committer commit, but doesn't wait for it.
 void
 end_op(int dev)
 {
-  int do_commit = 0;
+  struct proc *p = myproc();
 
   acquire(&log[dev].lock);
   log[dev].outstanding -= 1;
+  log[dev].reserved -= p->logcredit;
+  p->logcredit = 0;
   if(log[dev].committing)
     panic("log[dev].committing");
-  if(log[dev].outstanding == 0){
-    do_commit = 1;
-    log[dev].committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log[dev].outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
+  if(log[dev].outstanding == 0)
+    wakeup(&log[dev].lh);
+  // begin_op() may be waiting for log space,
+  // and giving back the rest of this op's reservation
+  // has made more room.
+  wakeup(&log);
+  release(&log[dev].lock);
+}
+
+// Wait until the updates of every FS system call that has
+// finished on dev are on disk.
+void
+log_sync(int dev)
+{
+  int target;
+
+  acquire(&log[dev].lock);
+  if(log[dev].committing || log[dev].lh.n > log[dev].committed){
+    // begin_op() waits while a commit is in progress, so
+    // the transaction being committed, or else the next one
+    // to commit, has all of our updates.
+    target = log[dev].ncommit + 1;
+    wakeup(&log[dev].lh);
+    while(log[dev].ncommit < target)
+      sleep(&log, &log[dev].lock);
   }
   release(&log[dev].lock);
+}
+
+// The committer kernel thread for dev: commit the
+// transaction each time it has no FS system calls left.
+static void
+committer(void *arg)
+{
+  int dev = (int)(uint64)arg;
+
+  acquire(&log[dev].lock);
+  for(;;){
+    while(log[dev].lh.n == log[dev].committed || log[dev].outstanding > 0)
+      sleep(&log[dev].lh, &log[dev].lock);
+
+    // let processes that are about to call begin_op()
+    // join this transaction before it commits.
+    release(&log[dev].lock);
+    yield();
+    acquire(&log[dev].lock);
+    if(log[dev].outstanding > 0)
+      continue;
+
+    log[dev].committing = 1;
+    release(&log[dev].lock);
 
-  if(do_commit){
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit(dev);
+
     acquire(&log[dev].lock);
     log[dev].committing = 0;
+    log[dev].ncommit++;
     wakeup(&log);
-    release(&log[dev].lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the current transaction's modified blocks from cache to log.
 static void
 write_log(int dev)
 {
-  int tail;
+  struct buf *to[LOGBATCH];
+  int tail, i, n;
 
-  for (tail = 0; tail < log[dev].lh.n; tail++) {
-    struct buf *to = bread(dev, log[dev].start+tail+1); // log block
-    struct buf *from = bread(dev, log[dev].lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = log[dev].committed; tail < log[dev].lh.n; tail += n) {
+    n = log[dev].lh.n - tail;
+    if (n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      to[i] = bread(dev, log[dev].start+tail+i+1); // log block
+      struct buf *from = bread(dev, log[dev].lh.block[tail+i]); // cache block
+      memmove(to[i]->data, from->data, BSIZE);
+      brelse(from);
+    }
+    bstart(to, n, 1);  // write the log
+    for (i = 0; i < n; i++) {
+      bwait(to[i]);
+      brelse(to[i]);
+    }
   }
 }
 
 static void
 commit(int dev)
 {
-  if (log[dev].lh.n > 0) {
+  if (log[dev].lh.n > log[dev].committed) {
     write_log(dev);     // Write modified blocks from cache to log
     write_head(dev);    // Write header to disk -- the real commit
-    install_trans(dev); // Now install writes to home locations
+    log[dev].committed = log[dev].lh.n;
+  }
+  if (log[dev].lh.n + CKPTSLACK > log[dev].size - 1) {
+    install_trans(dev, 0); // Now install writes to home locations
     log[dev].lh.n = 0;
-    write_head(dev);    // Erase the transaction from the log
+    log[dev].committed = 0;
+    write_head(dev);    // Erase the transactions from the log
   }
 }
 
@@ -213,6 +351,7 @@ commit(int dev)
 void
 log_write(struct buf *b)
 {
+  struct proc *p = myproc();
   int i;
 
   int dev = b->dev;
@@ -222,16 +361,22 @@ log_write(struct buf *b)
     panic("log_write outside of trans");
 
   acquire(&log[dev].lock);
-  for (i = 0; i < log[dev].lh.n; i++) {
+  for (i = log[dev].committed; i < log[dev].lh.n; i++) {
     if (log[dev].lh.block[i] == b->blockno)   // log absorbtion
       break;
   }
-  log[dev].lh.block[i] = b->blockno;
   if (i == log[dev].lh.n) {  // Add new block to log?
-    bpin(b);
-    log[dev].lh.n++;
+    // pin it, unless an earlier transaction already has.
+    for (i = 0; i < log[dev].committed; i++)
+      if (log[dev].lh.block[i] == b->blockno)
+        break;
+    if (i == log[dev].committed)
+      bpin(b);
+    log[dev].lh.block[log[dev].lh.n++] = b->blockno;
+    if (p->logcredit > 0) {
+      p->logcredit--;
+      log[dev].reserved--;
+    }
   }
   release(&log[dev].lock);
 }
-
-
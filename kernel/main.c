@@ -29,10 +29,12 @@ main()
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    pcinit();        // page cache
     iinit();         // inode cache
     fileinit();      // file table
     virtio_disk_init(minor(ROOTDEV)); // emulated hard disk
     userinit();      // first user process
+    swapinit();      // swap space on the second disk, and kswapd
     __sync_synchronize();
     started = 1;
   } else {
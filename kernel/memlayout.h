@@ -30,6 +30,14 @@
 #define CLINT 0x2000000L
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define CLINT_HZ 10000000L  // mtime's cycles per second in qemu.
+
+// the kernel maps the CLINT here, rather than at CLINT,
+// which is in the first gigabyte of addresses, where user
+// memory is in processes' kernel page tables.
+#define KCLINT 0x40000000L
+#define KCLINT_MTIMECMP(hartid) (KCLINT + 0x4000 + 8*(hartid))
+#define KCLINT_MTIME (KCLINT + 0xBFF8)
 
 // qemu puts programmable interrupt controller here.
 #define PLIC 0x0c000000L
@@ -63,6 +71,13 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap()ed files, allocated downward from MMAPTOP
+//   ...
 //   TRAPFRAME (p->tf, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// user memory ends where the kernel's device mappings
+// begin, so that a process's kernel page table can map
+// it at the same addresses. see kvmcreate().
+#define MMAPTOP PLIC
@@ -0,0 +1,352 @@
+//
+// File-backed memory: mmap() and munmap().
+//
+// Each process has NVMA regions, placed downward from MMAPTOP.
+// When a page of a region is first touched, mmapfault() maps
+// the file's page from the page cache: writable if the region
+// is MAP_SHARED, so that read() and write() see the same bytes,
+// and copy-on-write if it is MAP_PRIVATE. The pages of a
+// writable MAP_SHARED region that have been written to are
+// written back to the file when the region is unmapped by
+// munmap(), exit() or exec().
+//
+// A file that is some process's running program can't be
+// mapped writable and shared, since the program shares its
+// cached pages; nor can one that is mapped so be run. Each
+// such region counts in ip->nwmap, raised under ip's lock.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "page.h"
+
+// Find the region of p that contains va.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && va >= v->start && va < v->start + v->len)
+      return v;
+  return 0;
+}
+
+// Lowest address used by p's regions.
+// The heap must stay below it.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base;
+
+  base = MMAPTOP;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Choose an address for a new region of len bytes:
+// the highest free range below MMAPTOP, above the heap.
+// Returns 0 if there is no room.
+static uint64
+mmapaddr(struct proc *p, uint64 len)
+{
+  struct vma *v;
+  uint64 va;
+
+  va = MMAPTOP - len;
+again:
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len && va < v->start + v->len && v->start < va + len){
+      if(v->start < len)
+        return 0;
+      va = v->start - len;
+      goto again;
+    }
+  }
+  if(va < PGROUNDUP(p->sz))
+    return 0;
+  return va;
+}
+
+// Map len bytes of f, starting at offset off, into the
+// current process. The kernel chooses the address.
+// Returns the address, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 va;
+
+  if(len == 0 || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || f->ip->type != T_FILE)
+    return -1;
+  if(f->readable == 0)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && f->writable == 0)
+    return -1;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len == 0)
+      break;
+  if(v == &p->vma[NVMA])
+    return -1;
+
+  len = PGROUNDUP(len);
+  if((va = mmapaddr(p, len)) == 0)
+    return -1;
+
+  if(flags == MAP_SHARED && (prot & PROT_WRITE)){
+    ilock(f->ip);
+    if(f->ip->ntext > 0){
+      iunlock(f->ip);
+      return -1;
+    }
+    __sync_fetch_and_add(&f->ip->nwmap, 1);
+    iunlock(f->ip);
+  }
+
+  v->start = va;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = filedup(f);
+  v->off = off;
+  return va;
+}
+
+// Map the page at va of one of p's regions from its file.
+// va is page-aligned and not mapped yet. A page wholly past
+// the end of the file is a private page of zeroes.
+// returns 0 on success, -1 if va isn't in a region, the
+// access isn't allowed, or memory ran out.
+int
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  struct inode *ip;
+  struct page *pg;
+  char *mem;
+  uint off;
+  int perm, locked;
+
+  if((v = vmalookup(p, va)) == 0)
+    return -1;
+  if(v->prot == PROT_NONE || (write && (v->prot & PROT_WRITE) == 0))
+    return -1;
+
+  perm = PTE_U|PTE_R;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  // fileread() and filewrite() fault in the user buffer
+  // before locking their file's inode (see uvmprefault()), so
+  // this never waits for one inode's lock holding another's;
+  // but a fault in copyin() may still come from a write() to
+  // the mapped file itself, which already holds its lock.
+  ip = v->f->ip;
+  off = v->off + (va - v->start);
+  locked = holdingsleep(&ip->lock);
+  if(!locked)
+    ilock(ip);
+  pg = 0;
+  if(off < ip->size && (pg = igetpage(ip, off / PGSIZE)) == 0){
+    if(!locked)
+      iunlock(ip);
+    return -1;
+  }
+  if(!locked)
+    iunlock(ip);
+
+  if(pg == 0){
+    if((mem = kalloc()) == 0)
+      return -1;
+    memset(mem, 0, PGSIZE);
+    if(v->prot & PROT_WRITE)
+      perm |= PTE_W;
+  } else {
+    mem = pg->data;
+    krefinc(mem);
+    pcput(pg);
+    if(v->prot & PROT_WRITE)
+      perm |= (v->flags == MAP_SHARED ? PTE_W : PTE_COW);
+  }
+
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  // a private page written right away gets its copy now.
+  if(write && (perm & PTE_COW))
+    return uvmcow(p->pagetable, va);
+  return 0;
+}
+
+// Write the pages of [va, va+len) in v that have been
+// written to back to v's file, but not past its end.
+static void
+mmapwrite(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  struct inode *ip = v->f->ip;
+  // as in filewrite(), a few blocks per transaction.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint64 a, pa;
+  uint off;
+  pte_t *pte;
+  int i, n;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    off = v->off + (a - v->start);
+    for(i = 0; i < PGSIZE; i += max){
+      n = PGSIZE - i;
+      if(n > max)
+        n = max;
+      begin_op(ip->dev);
+      ilock(ip);
+      if(off + i + n > ip->size)
+        n = off + i < ip->size ? ip->size - (off + i) : 0;
+      if(n > 0)
+        writei(ip, 0, pa + i, off + i, n);
+      iunlock(ip);
+      end_op(ip->dev);
+    }
+  }
+}
+
+// Whether v counts in its inode's nwmap.
+static int
+vmawmap(struct vma *v)
+{
+  return v->flags == MAP_SHARED && (v->prot & PROT_WRITE);
+}
+
+// Remove [va, va+len), which is all of v or
+// a piece at one end of it, from p.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  struct file *f;
+
+  if(vmawmap(v))
+    mmapwrite(p, v, va, len);
+  uvmunmap(p->pagetable, va, len, 1);
+
+  if(va == v->start){
+    v->start += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0){
+    f = v->f;
+    v->f = 0;
+    if(vmawmap(v))
+      __sync_fetch_and_sub(&f->ip->nwmap, 1);
+    fileclose(f);
+  }
+}
+
+// Unmap [addr, addr+len) from the current process.
+// The range must lie within one region.
+// Returns 0, or -1.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *nv;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = vmalookup(p, addr)) == 0 || addr + len > v->start + v->len)
+    return -1;
+
+  if(addr > v->start && addr + len < v->start + v->len){
+    // a hole in the middle: what lies above it
+    // becomes a region of its own.
+    for(nv = p->vma; nv < &p->vma[NVMA]; nv++)
+      if(nv->len == 0)
+        break;
+    if(nv == &p->vma[NVMA])
+      return -1;
+    *nv = *v;
+    nv->start = addr + len;
+    nv->len = v->start + v->len - nv->start;
+    nv->off = v->off + (nv->start - v->start);
+    filedup(nv->f);
+    if(vmawmap(nv))
+      __sync_fetch_and_add(&nv->f->ip->nwmap, 1);
+    v->len = addr + len - v->start;
+  }
+
+  vmaunmap(p, v, addr, len);
+  return 0;
+}
+
+// Unmap all of p's regions, for exit() and exec().
+void
+mmapfree(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len)
+      vmaunmap(p, v, v->start, v->len);
+}
+
+// Give fork()'s child np the regions of p. The pages of
+// a MAP_SHARED region stay shared, and the pages of a
+// MAP_PRIVATE region become copy-on-write.
+// Returns 0, or -1 having unmapped what it mapped.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->len == 0)
+      continue;
+    if(uvmshare(p->pagetable, np->pagetable, v->start, v->len,
+                v->flags == MAP_PRIVATE) < 0)
+      goto bad;
+    np->vma[i] = *v;
+  }
+  for(i = 0; i < NVMA; i++){
+    if(np->vma[i].len){
+      filedup(np->vma[i].f);
+      if(vmawmap(&np->vma[i]))
+        __sync_fetch_and_add(&np->vma[i].f->ip->nwmap, 1);
+    }
+  }
+  return 0;
+
+ bad:
+  while(--i >= 0){
+    if(np->vma[i].len){
+      uvmunmap(np->pagetable, np->vma[i].start, np->vma[i].len, 1);
+      np->vma[i].len = 0;
+    }
+  }
+  return -1;
+}
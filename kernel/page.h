@@ -0,0 +1,10 @@
+struct page {
+  uint dev;
+  uint inum;
+  uint pgno;    // offset in the file / PGSIZE
+  int ref;      // kernel users; mappings count in kalloc's refcount
+  char *data;   // PGSIZE bytes from kalloc(), or 0 if unused
+  struct page *next; // hash chain, or free list
+  struct page *lrunext; // idle list, most recently used first
+  struct page *lruprev;
+};
@@ -1,14 +1,25 @@
-#define NPROC        10  // maximum number of processes
+#define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
+#define NVMA         16  // mmap()ed regions per process
+#define NSEG         4   // demand-paged program segments per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       0  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define DIROPBLOCKS  (MAXOPBLOCKS+DIRPROBE+3)  // ... an FS op that adds a directory entry writes
+#define LOGSIZE      254   // max data blocks in on-disk log
+#define NBUFMIN      (LOGSIZE+MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define NBUF         2048  // maximum size of disk block cache
+#define NPCACHE      4096  // maximum pages in the page cache
+#define RAMAX        64    // max read-ahead window, in blocks
+#define RAWINDOW     16    // default read-ahead window, in blocks
+#define FSSIZE       200000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define NDISK        2
+#define NPRIO        3     // scheduling priority levels
+#define BOOSTTICKS   32    // ticks between priority boosts
+#define SWAPDEV      1     // disk that holds swap space
+#define NSWAP        16384 // pages of swap space; see swap.img in Makefile
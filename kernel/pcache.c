@@ -0,0 +1,281 @@
+// Page cache.
+//
+// The page cache holds the contents of regular files in whole
+// pages from kalloc(), hashed on (dev, inum, page number), so
+// that each page of a file is in memory once. readi() copies
+// file data out of it, writei() updates the cached pages after
+// writing the blocks through the log, and mmap() maps the pages
+// straight into user address spaces. Disk I/O still goes
+// through the buffer cache: fs.c fills a missing page with
+// bread() and hands it to pcadd().
+//
+// Interface:
+// * pcget() looks up a page and takes a reference to it.
+// * pccached() checks whether a page is cached.
+// * pcadd() adds a freshly filled page, referenced.
+// * pcput() releases a reference.
+// * pcwrite() updates a page, if it is cached.
+// * pcinval() forgets all of a file's pages.
+//
+// Mapping a page into a process adds to its kalloc reference
+// count with krefinc(), and the cache's own reference is the
+// one from kalloc(). A page is only recycled, or given back to
+// kalloc() by pcshrink(), when neither the kernel nor any
+// process is using it. Pages without kernel references are
+// kept on a list in the order they were last released, so
+// the least recently used one is found without a search. Callers hold the inode's lock, which
+// keeps two processes from filling the same page at once.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "page.h"
+
+#define NPHASH     4093  // a prime near NPCACHE
+#define PHASH(dev, inum, pgno) (((dev)*31*31 + (inum)*31 + (pgno)) % NPHASH)
+#define PCGROWFREE 1024  // take a fresh page while this many are free
+
+struct {
+  struct spinlock lock;
+  struct page page[NPCACHE];
+  struct page *hash[NPHASH];
+  struct page *free;    // descriptors without data
+  struct page lru;      // pages with ref == 0, most recently used first
+  int npage;            // descriptors with data
+} pcache;
+
+void
+pcinit(void)
+{
+  struct page *pg;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.lru.lrunext = &pcache.lru;
+  pcache.lru.lruprev = &pcache.lru;
+  for(pg = pcache.page; pg < &pcache.page[NPCACHE]; pg++){
+    pg->next = pcache.free;
+    pcache.free = pg;
+  }
+}
+
+// Look for page pgno of file (dev, inum).
+// Caller must hold pcache.lock.
+static struct page*
+pcfind(uint dev, uint inum, uint pgno)
+{
+  struct page *pg;
+
+  for(pg = pcache.hash[PHASH(dev, inum, pgno)]; pg; pg = pg->next)
+    if(pg->dev == dev && pg->inum == inum && pg->pgno == pgno)
+      return pg;
+  return 0;
+}
+
+// Put pg, whose last reference was just released,
+// at the most recently used end of the list.
+// Caller must hold pcache.lock.
+static void
+lrupush(struct page *pg)
+{
+  pg->lrunext = pcache.lru.lrunext;
+  pg->lruprev = &pcache.lru;
+  pcache.lru.lrunext->lruprev = pg;
+  pcache.lru.lrunext = pg;
+}
+
+// Take pg off the list.
+// Caller must hold pcache.lock.
+static void
+lruunlink(struct page *pg)
+{
+  pg->lrunext->lruprev = pg->lruprev;
+  pg->lruprev->lrunext = pg->lrunext;
+}
+
+// Unhash pg, which has no references, and give its data
+// page back to kalloc(), or to the processes that still
+// map it.
+// Caller must hold pcache.lock.
+static void
+pcdrop(struct page *pg)
+{
+  struct page **pp;
+
+  lruunlink(pg);
+  pp = &pcache.hash[PHASH(pg->dev, pg->inum, pg->pgno)];
+  while(*pp != pg)
+    pp = &(*pp)->next;
+  *pp = pg->next;
+  kfree(pg->data);
+  pg->data = 0;
+  pcache.npage--;
+}
+
+// The least recently used page that no one is using or
+// mapping, or 0. A page that processes still map is in use,
+// so it moves to the recently used end as it is passed over;
+// a search only goes past each page once.
+// Caller must hold pcache.lock.
+static struct page*
+pclru(void)
+{
+  struct page *pg, *first;
+
+  first = 0;
+  while((pg = pcache.lru.lruprev) != &pcache.lru && pg != first){
+    if(krefcnt(pg->data) == 1)
+      return pg;
+    if(first == 0)
+      first = pg;
+    lruunlink(pg);
+    lrupush(pg);
+  }
+  return 0;
+}
+
+// Return page pgno of file (dev, inum) with a
+// reference taken, or 0 if it isn't cached.
+struct page*
+pcget(uint dev, uint inum, uint pgno)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  if((pg = pcfind(dev, inum, pgno)) != 0 && pg->ref++ == 0)
+    lruunlink(pg);
+  release(&pcache.lock);
+  return pg;
+}
+
+// Is page pgno of file (dev, inum) cached?
+int
+pccached(uint dev, uint inum, uint pgno)
+{
+  int r;
+
+  acquire(&pcache.lock);
+  r = pcfind(dev, inum, pgno) != 0;
+  release(&pcache.lock);
+  return r;
+}
+
+// Add data, a page from kalloc() holding page pgno of
+// file (dev, inum), to the cache, and return it with a
+// reference taken. A new page uses an unused descriptor
+// while memory is plentiful, and otherwise recycles the
+// least recently used idle page. Returns 0, leaving data
+// to the caller, if every page is in use.
+struct page*
+pcadd(uint dev, uint inum, uint pgno, char *data)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  if((pg = pcfind(dev, inum, pgno)) != 0){
+    if(pg->ref++ == 0)
+      lruunlink(pg);
+    release(&pcache.lock);
+    kfree(data);
+    return pg;
+  }
+
+  pg = 0;
+  if(pcache.free && kfreepages() >= PCGROWFREE)
+    pg = pcache.free;
+  else if((pg = pclru()) != 0)
+    pcdrop(pg);
+  else
+    pg = pcache.free;
+  if(pg == 0){
+    release(&pcache.lock);
+    return 0;
+  }
+  if(pg == pcache.free)
+    pcache.free = pg->next;
+
+  pg->dev = dev;
+  pg->inum = inum;
+  pg->pgno = pgno;
+  pg->ref = 1;
+  pg->data = data;
+  pg->next = pcache.hash[PHASH(dev, inum, pgno)];
+  pcache.hash[PHASH(dev, inum, pgno)] = pg;
+  pcache.npage++;
+  release(&pcache.lock);
+  return pg;
+}
+
+// Release a reference to pg.
+void
+pcput(struct page *pg)
+{
+  acquire(&pcache.lock);
+  if(pg->ref < 1)
+    panic("pcput");
+  if(--pg->ref == 0)
+    lrupush(pg);
+  release(&pcache.lock);
+}
+
+// Copy n bytes from src to offset off of file (dev, inum)
+// in the cache, if that page is cached. The bytes must
+// all lie in one page.
+void
+pcwrite(uint dev, uint inum, uint off, char *src, uint n)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  if((pg = pcfind(dev, inum, off / PGSIZE)) != 0)
+    memmove(pg->data + off % PGSIZE, src, n);
+  release(&pcache.lock);
+}
+
+// Forget the cached pages of file (dev, inum),
+// whose contents are being discarded.
+void
+pcinval(uint dev, uint inum)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.page; pg < &pcache.page[NPCACHE]; pg++){
+    if(pg->data && pg->dev == dev && pg->inum == inum){
+      if(pg->ref > 0)
+        panic("pcinval");
+      pcdrop(pg);
+      pg->next = pcache.free;
+      pcache.free = pg;
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Give up to n idle pages back to kalloc(),
+// least recently used first.
+// Returns the number of pages freed.
+int
+pcshrink(int n)
+{
+  struct page *pg;
+  int freed;
+
+  acquire(&pcache.lock);
+  for(freed = 0; freed < n && (pg = pclru()) != 0; freed++){
+    pcdrop(pg);
+    pg->next = pcache.free;
+    pcache.free = pg;
+  }
+  release(&pcache.lock);
+  return freed;
+}
+
+// Return the number of cached pages.
+// Read without the lock, so only an estimate.
+int
+pcpages(void)
+{
+  return pcache.npage;
+}
@@ -17,6 +17,7 @@ struct pipe {
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int reading;    // a reader is copying out bytes it hasn't taken yet
 };
 
 int
@@ -34,6 +35,7 @@ pipealloc(struct file **f0, struct file **f1)
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->reading = 0;
   memset(&pi->lock, 0, sizeof(pi->lock));
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -73,55 +75,72 @@ pipeclose(struct pipe *pi, int writable)
     release(&pi->lock);
 }
 
+// Data moves between the user and the pipe a buffer at a
+// time, copied without pi->lock held, since the copy may
+// have to page in user memory.
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
-  char ch;
+  int i, j, m;
+  char buf[PIPESIZE];
   struct proc *pr = myproc();
 
-  acquire(&pi->lock);
-  for(i = 0; i < n; i++){
-    while(pi->nwrite == pi->nread + PIPESIZE){  //DOC: pipewrite-full
-      if(pi->readopen == 0 || myproc()->killed){
-        release(&pi->lock);
-        return -1;
+  for(i = 0; i < n; i += m){
+    m = n - i;
+    if(m > sizeof(buf))
+      m = sizeof(buf);
+    if(copyin(pr->pagetable, buf, addr + i, m) == -1)
+      break;
+    acquire(&pi->lock);
+    for(j = 0; j < m; j++){
+      while(pi->nwrite == pi->nread + PIPESIZE){  //DOC: pipewrite-full
+        if(pi->readopen == 0 || myproc()->killed){
+          release(&pi->lock);
+          return -1;
+        }
+        wakeup(&pi->nread);
+        sleep(&pi->nwrite, &pi->lock);
       }
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
+      pi->data[pi->nwrite++ % PIPESIZE] = buf[j];
     }
-    if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-      break;
-    pi->data[pi->nwrite++ % PIPESIZE] = ch;
+    wakeup(&pi->nread);
+    release(&pi->lock);
   }
-  wakeup(&pi->nread);
-  release(&pi->lock);
-  return n;
+  return i;
 }
 
+// The bytes are only taken from the pipe once they have
+// been copied out, so that none are lost if the copy fails.
+// Meanwhile pi->reading keeps other readers away.
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, r;
   struct proc *pr = myproc();
-  char ch;
+  char buf[PIPESIZE];
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while(pi->reading || (pi->nread == pi->nwrite && pi->writeopen)){  //DOC: pipe-empty
     if(myproc()->killed){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  for(i = 0; i < n && i < sizeof(buf); i++){  //DOC: piperead-copy
+    if(pi->nread + i == pi->nwrite)
       break;
+    buf[i] = pi->data[(pi->nread + i) % PIPESIZE];
   }
+  pi->reading = 1;
+  release(&pi->lock);
+  r = copyout(pr->pagetable, addr, buf, i);
+  acquire(&pi->lock);
+  pi->reading = 0;
+  if(r == 0)
+    pi->nread += i;
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  wakeup(&pi->nread);
   release(&pi->lock);
-  return i;
+  return r == 0 ? i : -1;
 }
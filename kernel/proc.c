@@ -19,9 +19,102 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
+static void freeproc(struct proc *p);
 static void wakeup1(struct proc *chan);
+static void sleep1(void*, struct spinlock*, uint, uint64);
+static void setrunnable(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
+extern pagetable_t kernel_pagetable; // vm.c
+
+// Each process gets an address-space ID (ASID) to tag its
+// TLB entries with, so that neither traps nor switching
+// processes need flush the TLB; the kernel uses ASID 0.
+// ASIDs are handed out in generations. When a generation
+// runs out, a new one starts, every process must get a new
+// ASID, and each CPU flushes its TLB before it next uses one.
+struct {
+  struct spinlock lock;
+  uint64 max;   // largest ASID the MMU supports, or 0
+  uint64 gen;   // current generation, above the ASID bits
+  uint64 next;  // next unused ASID of this generation
+} asids;
+
+// Each CPU has a run queue of RUNNABLE processes, which its
+// scheduler() takes them from. setrunnable() puts a process
+// on the queue of the CPU it last ran on, where its caches
+// may still be warm, unless the current CPU's is shorter. A
+// CPU with nothing to run steals from the longest queue. A
+// process is on a queue only while RUNNABLE, and on one at
+// most. Lock order: p->lock, then a queue's lock.
+//
+// The queues are multilevel feedback queues: a queue holds a
+// FIFO list for each of NPRIO priority levels, and scheduler()
+// takes from the highest level, 0, that isn't empty. A process
+// starts at the level of its nice value. Each timer tick that
+// it runs is charged to it, and once it has used up the time
+// slice of its level, QUANTUM(level) ticks in all, it moves
+// down a level. Every BOOSTTICKS ticks, all processes go back
+// to their nice level, so that none starves. See schedintr().
+#define QUANTUM(level) (1 << (level))
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;            // length; read without the lock as a hint
+} runq[NCPU];
+
+int boost;          // how many boosts there have been
+
+// Sleeping processes wait on queues hashed by channel, so
+// that wakeup() need only look at those that might be
+// sleeping on its channel. A process is on the queue of
+// p->chan while SLEEPING, until wakeup() or wakeproc() takes
+// it off; p->chan doesn't change while it is there. Lock
+// order: a sleep() caller's lock, then p->lock, then a
+// wait queue's lock.
+#define NSLEEPQ 61
+#define WAKEBATCH 8
+#define SLEEPQ(chan) (&sleepq[(uint64)(chan) / 8 % NSLEEPQ])
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
+// A process in sleeptimeout() also waits on a hierarchical
+// timer wheel, so that a clock tick need only look at the
+// processes whose time has come. Level 0 has a slot for each
+// of the next TWSLOTS ticks, and each level above has slots
+// TWSLOTS times as long. When the ticks reach a slot above
+// level 0, its processes are moved down to lower levels. A
+// process is on the wheel until its time comes or it wakes up
+// some other way; p->wakeat doesn't change while it is there.
+// Lock order: p->lock, then the wheel's lock.
+#define TWBITS    6
+#define TWSLOTS   (1 << TWBITS)
+#define TWLEVELS  4
+#define TWMAX     ((1 << (TWLEVELS*TWBITS)) - 2)  // longest timeout
+#define TWSLOT(t, k) (((t) >> ((k)*TWBITS)) & (TWSLOTS-1))
+
+struct {
+  struct spinlock lock;
+  uint now;         // the last tick handled
+  struct proc *slot[TWLEVELS][TWSLOTS];
+} wheel;
+
+// A process in sleepuntil() waits on the clock queue of the
+// CPU it went to sleep on, sorted by deadline, and that CPU's
+// timer is set for the first; see clockarm() in trap.c. It is
+// there until its deadline passes or it wakes up some other
+// way; p->wakeclock doesn't change while it is there. Lock
+// order: p->lock, then a clock queue's lock.
+struct clockq {
+  struct spinlock lock;
+  struct proc *head;
+} clockq[NCPU];
 
 void
 procinit(void)
@@ -29,6 +122,13 @@ procinit(void)
   struct proc *p;
   
   initlock(&pid_lock, "nextpid");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+  initlock(&wheel.lock, "wheel");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&clockq[i].lock, "clockq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
 
@@ -42,9 +142,57 @@ procinit(void)
       kvmmap(va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
       p->kstack = va;
   }
+
+  // the ASID bits that the MMU implements read back as ones.
+  initlock(&asids.lock, "asid");
+  w_satp(MAKE_SATP(kernel_pagetable, SATP_ASIDMASK));
+  asids.max = (r_satp() >> SATP_ASIDSHIFT) & SATP_ASIDMASK;
+  asids.gen = SATP_ASIDMASK + 1;
+  asids.next = 1;
   kvminithart();
 }
 
+// Return the ASID for running p's page tables on this CPU,
+// first giving p one of the current generation if it has
+// none. Returns 0 if the MMU has no ASIDs, in which case
+// switching to or from p's page tables must flush the TLB.
+// Called with interrupts off.
+uint64
+procasid(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  int i, flush;
+
+  if(asids.max == 0)
+    return 0;
+
+  // the unlocked checks are safe: if a new generation
+  // starts just after them, p still has an ASID that no
+  // one else has on this CPU until it next gets here.
+  if((p->asid & ~SATP_ASIDMASK) != __atomic_load_n(&asids.gen, __ATOMIC_SEQ_CST) ||
+     __atomic_load_n(&c->tlbflush, __ATOMIC_SEQ_CST)){
+    acquire(&asids.lock);
+    if((p->asid & ~SATP_ASIDMASK) != asids.gen){
+      if(asids.next > asids.max){
+        asids.gen += SATP_ASIDMASK + 1;
+        asids.next = 1;
+        for(i = 0; i < NCPU; i++)
+          cpus[i].tlbflush = 1;
+      }
+      p->asid = asids.gen | asids.next++;
+      p->tlbcpus = 0;
+    }
+    flush = c->tlbflush;
+    c->tlbflush = 0;
+    release(&asids.lock);
+    if(flush)
+      sfence_vma();
+  }
+
+  p->tlbcpus |= 1 << cpuid();
+  return p->asid & SATP_ASIDMASK;
+}
+
 // Must be called with interrupts disabled,
 // to prevent race with process being moved
 // to a different CPU.
@@ -114,8 +262,14 @@ found:
     return 0;
   }
 
-  // An empty user page table.
+  // An empty user page table, and the kernel
+  // page table to use while running p.
   p->pagetable = proc_pagetable(p);
+  if((p->kpagetable = kvmcreate(p->pagetable)) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
@@ -135,9 +289,13 @@ freeproc(struct proc *p)
   if(p->tf)
     kfree((void*)p->tf);
   p->tf = 0;
+  if(p->kpagetable)
+    kfree((void*)p->kpagetable);
+  p->kpagetable = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  p->asid = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -145,6 +303,12 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
+  p->karg = 0;
+  p->cpu = 0;
+  p->nice = 0;
+  p->prio = 0;
+  p->slice = 0;
   p->state = UNUSED;
 }
 
@@ -216,7 +380,7 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
@@ -226,14 +390,20 @@ userinit(void)
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // pages are allocated when first touched, by vmfault(),
+    // but refuse growth that free memory, counting pages
+    // the page cache would give back and free swap space,
+    // could never back.
+    if(sz + n > mmapbase(p) ||
+       PGROUNDUP(sz + n) - PGROUNDUP(sz) >
+       (kfreepages() + pcpages() + swappages()) * PGSIZE)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -250,6 +420,11 @@ fork(void)
   struct proc *np;
   struct proc *p = myproc();
 
+  // uvmcopy() can't read pages in from swap
+  // holding np->lock, so do it first.
+  if(uvmswapinall(p->pagetable, p->sz) < 0)
+    return -1;
+
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
@@ -263,6 +438,13 @@ fork(void)
   }
   np->sz = p->sz;
 
+  // share mmap()ed regions.
+  if(mmapcopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   np->parent = p;
 
   // copy saved user registers.
@@ -276,18 +458,52 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exe){
+    np->exe = idup(p->exe);
+    __sync_fetch_and_add(&np->exe->ntext, 1);
+  }
+  memmove(np->seg, p->seg, sizeof(p->seg));
+  np->nseg = p->nseg;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->nice = p->nice;
+  np->prio = p->nice;
+
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  setrunnable(np);
 
   release(&np->lock);
 
   return pid;
 }
 
+// Create a kernel thread that runs fn(arg) in the kernel,
+// with no user memory. fn must never return.
+// Returns the new thread's pid, or -1.
+int
+kthread(void (*fn)(void*), void *arg, char *name)
+{
+  int pid;
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return -1;
+
+  // start at kthreadret instead of forkret.
+  p->context.ra = (uint64)kthreadret;
+  p->kfn = fn;
+  p->karg = arg;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  pid = p->pid;
+  setrunnable(p);
+  release(&p->lock);
+
+  return pid;
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold p->lock.
 void
@@ -325,6 +541,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Unmap mmap()ed files, writing back shared pages.
+  mmapfree(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -334,10 +553,16 @@ exit(int status)
     }
   }
 
+  if(p->exe)
+    __sync_fetch_and_sub(&p->exe->ntext, 1);
   begin_op(ROOTDEV);
   iput(p->cwd);
+  if(p->exe)
+    iput(p->exe);
   end_op(ROOTDEV);
   p->cwd = 0;
+  p->exe = 0;
+  p->nseg = 0;
 
   // we might re-parent a child to init. we can't be precise about
   // waking up init, since we can't acquire its lock once we've
@@ -386,7 +611,7 @@ int
 wait(uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
   // hold p->lock for the whole time to avoid lost
@@ -408,15 +633,15 @@ wait(uint64 addr)
         if(np->state == ZOMBIE){
           // Found one.
           pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
+          xstate = np->xstate;
           freeproc(np);
           release(&np->lock);
           release(&p->lock);
+          // not under the locks: the copy may have
+          // to page in user memory, and sleep.
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&np->lock);
@@ -434,6 +659,117 @@ wait(uint64 addr)
   }
 }
 
+// Move p back up to its nice level if there has been a boost
+// since it last looked. Caller must hold p->lock.
+static void
+boosted(struct proc *p)
+{
+  int b = __atomic_load_n(&boost, __ATOMIC_RELAXED);
+
+  if(p->boost != b){
+    p->boost = b;
+    p->prio = p->nice;
+    p->slice = 0;
+  }
+}
+
+// Append p to the list for level prio of q.
+// Caller must hold q->lock.
+static void
+runqput(struct runq *q, struct proc *p, int prio)
+{
+  p->rqnext = 0;
+  if(q->tail[prio])
+    q->tail[prio]->rqnext = p;
+  else
+    q->head[prio] = p;
+  q->tail[prio] = p;
+}
+
+// Make p RUNNABLE and put it on a run queue.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *q;
+  int id;
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+  p->state = RUNNABLE;
+  boosted(p);
+
+  push_off();
+  id = cpuid();
+  pop_off();
+  q = &runq[p->cpu];
+  if(runq[id].n < q->n)
+    q = &runq[id];
+
+  acquire(&q->lock);
+  runqput(q, p, p->prio);
+  q->n++;
+  release(&q->lock);
+}
+
+// Take the first process of the highest level of CPU id's
+// run queue, or return 0 if it is empty.
+static struct proc*
+runqget(int id)
+{
+  struct runq *q = &runq[id];
+  struct proc *p;
+  int i;
+
+  acquire(&q->lock);
+  p = 0;
+  for(i = 0; i < NPRIO; i++){
+    if((p = q->head[i]) != 0){
+      q->head[i] = p->rqnext;
+      if(q->head[i] == 0)
+        q->tail[i] = 0;
+      q->n--;
+      break;
+    }
+  }
+  release(&q->lock);
+  return p;
+}
+
+// The highest level of a process on CPU id's run queue,
+// or NPRIO if it is empty. Only a hint, without the lock.
+static int
+runqtop(int id)
+{
+  int i;
+
+  for(i = 0; i < NPRIO; i++)
+    if(runq[id].head[i])
+      break;
+  return i;
+}
+
+// Steal a process for idle CPU id from the
+// longest of the other CPUs' run queues.
+// Returns 0 if they are all empty.
+static struct proc*
+runqsteal(int id)
+{
+  int i, victim, most;
+
+  victim = -1;
+  most = 0;
+  for(i = 0; i < NCPU; i++){
+    if(i != id && runq[i].n > most){
+      most = runq[i].n;
+      victim = i;
+    }
+  }
+  if(victim < 0)
+    return 0;
+  return runqget(victim);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -446,44 +782,57 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by giving devices a chance to interrupt.
     intr_on();
 
-    // Run the for loop with interrupts off to avoid
+    // Look for a process with interrupts off to avoid
     // a race between an interrupt and WFI, which would
     // cause a lost wakeup.
     intr_off();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->scheduler, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
-
-      // ensure that release() doesn't enable interrupts.
-      // again to avoid a race between interrupt and WFI.
-      c->intena = 0;
-
-      release(&p->lock);
-    }
-    if(found == 0){
+    if((p = runqget(id)) == 0 && (p = runqsteal(id)) == 0){
       asm volatile("wfi");
+      continue;
     }
+
+    // p is off the queues now, so no other CPU can choose
+    // it. If it is still switching out on the CPU that it
+    // last ran on, that CPU holds p->lock until it is done.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+    boosted(p);
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->cpu = id;
+    c->proc = p;
+    w_satp(MAKE_SATP(p->kpagetable, procasid(p)));
+    if(asids.max == 0)
+      sfence_vma();
+    swtch(&c->scheduler, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+
+    // back to the kernel's page table, since p's may be
+    // freed once p->lock is released.
+    w_satp(MAKE_SATP(kernel_pagetable, 0));
+    if(asids.max == 0)
+      sfence_vma();
+
+    // ensure that release() doesn't enable interrupts.
+    // again to avoid a race between interrupt and WFI.
+    c->intena = 0;
+
+    release(&p->lock);
   }
 }
 
@@ -514,13 +863,102 @@ sched(void)
   mycpu()->intena = intena;
 }
 
+// Called from usertrap() and kerneltrap() when a device
+// interrupt, of the kind devintr() returned in which_dev,
+// interrupts the current process p. A timer tick is charged
+// to p's time slice, and if that is used up, p moves down a
+// level. returns whether p should yield(): its slice is used
+// up, or a process of a higher level, perhaps just woken by
+// the interrupt, waits on this CPU's run queue.
+int
+schedintr(int which_dev)
+{
+  struct proc *p = myproc();
+  int r;
+
+  acquire(&p->lock);
+  boosted(p);
+  r = 0;
+  if(which_dev == 2 && ++p->slice >= QUANTUM(p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+    r = 1;
+  }
+  if(runqtop(cpuid()) < p->prio)
+    r = 1;
+  release(&p->lock);
+  return r;
+}
+
+// Move every process back up to its nice level, for
+// clockintr() every BOOSTTICKS ticks. Those on run queues
+// move to the list of that level now, the rest next time
+// they are made RUNNABLE or interrupted; see boosted().
+void
+schedboost(void)
+{
+  struct runq *q;
+  struct proc *p, *list;
+  int i;
+
+  __atomic_fetch_add(&boost, 1, __ATOMIC_RELAXED);
+  for(q = runq; q < &runq[NCPU]; q++){
+    acquire(&q->lock);
+    for(i = 1; i < NPRIO; i++){
+      list = q->head[i];
+      q->head[i] = q->tail[i] = 0;
+      while((p = list) != 0){
+        list = p->rqnext;
+        // p->nice is read without p->lock, which can't be
+        // acquired here; a nice() racing with this only
+        // affects p's place until it runs.
+        runqput(q, p, p->nice < i ? p->nice : i);
+      }
+    }
+    release(&q->lock);
+  }
+}
+
+// Set the nice value of the process with the given pid, or
+// of the current process if pid is 0, to n: the priority
+// level, from 0, the highest, to NPRIO-1, that it starts at
+// and is boosted back to. returns the old value, or -1.
+int
+setnice(int pid, int n)
+{
+  struct proc *p;
+  int old;
+
+  if(n < 0 || n >= NPRIO)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      old = p->nice;
+      p->nice = n;
+      // never above its nice level.
+      if(p->prio < n){
+        p->prio = n;
+        p->slice = 0;
+      }
+      release(&p->lock);
+      return old;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -546,32 +984,168 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn(p->karg);
+  panic("kthread returned");
+}
+
+// Put p on the timer wheel, in the slot of the
+// lowest level that reaches p->wakeat.
+// Caller must hold the wheel's lock.
+static void
+wheeladd(struct proc *p)
+{
+  struct proc **head;
+  uint d;
+  int k;
+
+  d = p->wakeat - wheel.now;
+  for(k = 0; k < TWLEVELS-1 && d >= (1U << ((k+1)*TWBITS)); k++)
+    ;
+  head = &wheel.slot[k][TWSLOT(p->wakeat, k)];
+  p->twnext = *head;
+  if(*head)
+    (*head)->twprev = &p->twnext;
+  *head = p;
+  p->twprev = head;
+}
+
+// Take p off the timer wheel, if it is on it.
+// Caller must hold the wheel's lock.
+static void
+wheeldel(struct proc *p)
+{
+  if(p->twprev == 0)
+    return;
+  *p->twprev = p->twnext;
+  if(p->twnext)
+    p->twnext->twprev = p->twprev;
+  p->twnext = 0;
+  p->twprev = 0;
+}
+
+// Take p off the clock queue it is on, if it still is.
+static void
+clockdel(struct proc *p)
+{
+  struct clockq *cq = &clockq[p->cqcpu];
+  struct proc **pp;
+
+  acquire(&cq->lock);
+  for(pp = &cq->head; *pp; pp = &(*pp)->cqnext){
+    if(*pp == p){
+      *pp = p->cqnext;
+      break;
+    }
+  }
+  release(&cq->lock);
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
+{
+  sleep1(chan, lk, 0, 0);
+}
+
+// Like sleep(), but if n isn't 0, wake up after n ticks
+// even if nothing has woken p on chan by then. As with
+// sleep(), the caller must check why it woke up.
+void
+sleeptimeout(void *chan, struct spinlock *lk, uint n)
+{
+  sleep1(chan, lk, n, 0);
+}
+
+// Like sleeptimeout(), but wake up once the CLINT's time
+// reaches when, to the cycle rather than the tick.
+void
+sleepuntil(void *chan, struct spinlock *lk, uint64 when)
+{
+  sleep1(chan, lk, 0, when);
+}
+
+// sleep on chan, with a timeout of n ticks if n isn't 0,
+// and a deadline of CLINT time when if when isn't 0.
+static void
+sleep1(void *chan, struct spinlock *lk, uint n, uint64 when)
 {
   struct proc *p = myproc();
   
+  struct sleepq *q = SLEEPQ(chan);
+  struct clockq *cq;
+  struct proc **pp;
+  
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once p is on chan's wait queue, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
-  if(lk != &p->lock){  //DOC: sleeplock0
+  // (wakeup finds p there, and then waits for
+  // p->lock until p has given up the CPU),
+  // so it's okay to release lk. Likewise for
+  // the timer wheel and the clock queues.
+  if(lk != &p->lock)  //DOC: sleeplock0
     acquire(&p->lock);  //DOC: sleeplock1
-    release(lk);
-  }
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  acquire(&q->lock);
+  p->sqnext = q->head;
+  q->head = p;
+  release(&q->lock);
+
+  if(n > 0){
+    if(n > TWMAX)
+      n = TWMAX;
+    acquire(&wheel.lock);
+    p->wakeat = ticks + n;
+    wheeladd(p);
+    release(&wheel.lock);
+  }
+
+  if(when > 0){
+    p->wakeclock = when;
+    p->cqcpu = cpuid();
+    cq = &clockq[p->cqcpu];
+    acquire(&cq->lock);
+    for(pp = &cq->head; *pp && (*pp)->wakeclock <= when; pp = &(*pp)->cqnext)
+      ;
+    p->cqnext = *pp;
+    *pp = p;
+    // the timer may be set for a later deadline, or the tick.
+    if(cq->head == p)
+      clockarm(when);
+    release(&cq->lock);
+  }
+
+  if(lk != &p->lock)
+    release(lk);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  if(n > 0){
+    acquire(&wheel.lock);
+    wheeldel(p);
+    release(&wheel.lock);
+    p->wakeat = 0;
+  }
+  if(when > 0){
+    clockdel(p);
+    p->wakeclock = 0;
+  }
 
   // Reacquire original lock.
   if(lk != &p->lock){
@@ -580,20 +1154,146 @@ sleep(void *chan, struct spinlock *lk)
   }
 }
 
+// Take sleeping p off its wait queue, if wakeup() hasn't
+// already, and make it RUNNABLE. Caller must hold p->lock.
+static void
+wakeproc(struct proc *p)
+{
+  struct sleepq *q = SLEEPQ(p->chan);
+  struct proc **pp;
+
+  acquire(&q->lock);
+  for(pp = &q->head; *pp; pp = &(*pp)->sqnext){
+    if(*pp == p){
+      *pp = p->sqnext;
+      break;
+    }
+  }
+  release(&q->lock);
+  setrunnable(p);
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
+// Only chan's wait queue is searched. The sleepers are taken
+// off it before their p->locks are acquired, since sleep()
+// takes the locks in the other order; by then, a process may
+// have been woken some other way, so each is checked again.
+// They are taken WAKEBATCH at a time, to spare the stack.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct sleepq *q = SLEEPQ(chan);
+  struct proc *p, **pp, *woken[WAKEBATCH];
+  int i, n;
+
+  do {
+    n = 0;
+    acquire(&q->lock);
+    for(pp = &q->head; (p = *pp) != 0 && n < WAKEBATCH; ){
+      if(p->chan == chan){
+        *pp = p->sqnext;
+        woken[n++] = p;
+      } else {
+        pp = &p->sqnext;
+      }
+    }
+    release(&q->lock);
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+    for(i = 0; i < n; i++){
+      p = woken[i];
+      acquire(&p->lock);
+      if(p->state == SLEEPING && p->chan == chan)
+        wakeproc(p);
+      release(&p->lock);
     }
-    release(&p->lock);
+  } while(n == WAKEBATCH);
+}
+
+// Move the timer wheel on to tick t, waking up the
+// processes in sleeptimeout() whose time has come; called
+// by clockintr() each tick. Like wakeup(), takes them off
+// the wheel WAKEBATCH at a time, and then checks each again
+// under its p->lock, since it may have woken up some other
+// way in between.
+void
+timerexpire(uint t)
+{
+  struct proc *p, *next, **head, *woken[WAKEBATCH];
+  uint now;
+  int i, k, n;
+
+  acquire(&wheel.lock);
+  while(wheel.now != t){
+    wheel.now++;
+    // entering a new slot of level k-1 means leaving
+    // one of level k; move its processes down.
+    for(k = 1; k < TWLEVELS && TWSLOT(wheel.now, k-1) == 0; k++){
+      head = &wheel.slot[k][TWSLOT(wheel.now, k)];
+      for(p = *head, *head = 0; p; p = next){
+        next = p->twnext;
+        wheeladd(p);
+      }
+    }
+    // level 0's slot now holds the processes due now,
+    // and those added since that are due a lap later.
+    now = wheel.now;
+    head = &wheel.slot[0][TWSLOT(now, 0)];
+    do {
+      n = 0;
+      for(p = *head; p && n < WAKEBATCH; p = next){
+        next = p->twnext;
+        if(p->wakeat == now){
+          wheeldel(p);
+          woken[n++] = p;
+        }
+      }
+      release(&wheel.lock);
+
+      for(i = 0; i < n; i++){
+        p = woken[i];
+        acquire(&p->lock);
+        if(p->state == SLEEPING && p->wakeat == now)
+          wakeproc(p);
+        release(&p->lock);
+      }
+      acquire(&wheel.lock);
+    } while(n == WAKEBATCH);
   }
+  release(&wheel.lock);
+}
+
+// Wake up the processes on this CPU's clock queue whose
+// deadlines have passed at CLINT time now; called by
+// timerintr() with interrupts off. Like timerexpire(),
+// takes them off WAKEBATCH at a time and checks each again.
+// returns the next deadline on the queue, or 0 if none.
+uint64
+clockexpire(uint64 now)
+{
+  struct clockq *cq = &clockq[cpuid()];
+  struct proc *p, *woken[WAKEBATCH];
+  uint64 next;
+  int i, n;
+
+  do {
+    acquire(&cq->lock);
+    for(n = 0; (p = cq->head) != 0 && p->wakeclock <= now && n < WAKEBATCH; n++){
+      cq->head = p->cqnext;
+      woken[n] = p;
+    }
+    next = cq->head ? cq->head->wakeclock : 0;
+    release(&cq->lock);
+
+    for(i = 0; i < n; i++){
+      p = woken[i];
+      acquire(&p->lock);
+      if(p->state == SLEEPING && p->wakeclock != 0 && p->wakeclock <= now)
+        wakeproc(p);
+      release(&p->lock);
+    }
+  } while(n == WAKEBATCH);
+  return next;
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -604,7 +1304,7 @@ wakeup1(struct proc *p)
   if(!holding(&p->lock))
     panic("wakeup1");
   if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    wakeproc(p);
   }
 }
 
@@ -622,7 +1322,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        wakeproc(p);
       }
       release(&p->lock);
       return 0;
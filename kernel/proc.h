@@ -24,6 +24,8 @@ struct cpu {
   struct context scheduler;   // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int tlbflush;               // Flush the TLB before next using an ASID
+  uint64 nexttick;            // CLINT time of the next clock tick
 };
 
 extern struct cpu cpus[NCPU];
@@ -82,6 +84,27 @@ struct trapframe {
 
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of a process's address space that mmap()
+// maps to a file. Unused if len is 0.
+struct vma {
+  uint64 start;                // Page-aligned start address
+  uint64 len;                  // Length in bytes, a multiple of PGSIZE
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // The mapped file
+  uint off;                    // File offset of start
+};
+
+// A segment of the program that exec() left in the
+// program's file, to be paged in on demand.
+struct seg {
+  uint64 va;                   // Page-aligned start address
+  uint64 memsz;                // Bytes in memory
+  uint off;                    // File offset of va
+  uint filesz;                 // Bytes from the file; the rest are zero
+  int flags;                   // ELF_PROG_FLAG_*
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -93,14 +116,40 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU it last ran on
+  int nice;                    // Priority level it starts at, from nice()
+  int prio;                    // Priority level now, 0 the highest
+  int slice;                   // Ticks run at this level
+  int boost;                   // Boosts seen
+  uint wakeat;                 // Tick a timed sleep ends at, or 0
+  uint64 wakeclock;            // CLINT time a sleepuntil() ends at, or 0
+  int cqcpu;                   // CPU whose clock queue it waits on then
+
+  // the lock of the run or wait queue p is on must be held to use this:
+  struct proc *rqnext;         // Next RUNNABLE process on the queue
+  struct proc *sqnext;         // Next process sleeping on the queue
+  struct proc *twnext;         // Next process in the timer wheel slot
+  struct proc **twprev;        // What points to p there; 0 if not on the wheel
+  struct proc *cqnext;         // Next process on the clock queue
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // Page table
+  pagetable_t kpagetable;      // Kernel page table, sharing user memory
+  uint64 asid;                 // ASID, tagged with its generation, or 0
+  int tlbcpus;                 // CPUs whose TLBs may hold entries for asid
   struct trapframe *tf;        // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // mmap()ed files
+  struct inode *exe;           // Program file, for demand paging
+  struct seg seg[NSEG];        // Segments of exe still paged in on demand
+  int nseg;
   char name[16];               // Process name (debugging)
+  int logcredit;               // Log blocks reserved by begin_op() and unused
+  int kpreempt;                // Preempted in the kernel; see swap.c
+  void (*kfn)(void*);          // Kernel thread: function to run
+  void *karg;                  // Kernel thread: argument to kfn
 };
@@ -184,7 +184,12 @@ w_mtvec(uint64 x)
 // use riscv's sv39 page table scheme.
 #define SATP_SV39 (8L << 60)
 
-#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+// the address-space ID (ASID) field of satp; the MMU
+// may implement fewer than its 16 bits, or none.
+#define SATP_ASIDSHIFT 44
+#define SATP_ASIDMASK 0xFFFFL
+
+#define MAKE_SATP(pagetable, asid) (SATP_SV39 | ((uint64)(asid) << SATP_ASIDSHIFT) | (((uint64)pagetable) >> 12))
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -319,6 +324,20 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB's entries for va in address space asid.
+static inline void
+sfence_vma_page(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+}
+
+// flush all the TLB's entries for address space asid.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
@@ -326,11 +345,19 @@ sfence_vma()
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+#define MEGAPGSIZE (512*PGSIZE) // bytes per megapage, a leaf at level 1
+
+#define MEGAPGROUNDDOWN(a) (((a)) & ~(MEGAPGSIZE-1))
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty
+#define PTE_COW (1L << 8) // copy-on-write (RSW bit)
+#define PTE_MEGA (1L << 9) // megapage leaf at level 1 (RSW bit)
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -339,6 +366,15 @@ sfence_vma()
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// a PTE without PTE_V that isn't zero is for a page out in
+// swap, with the swap slot where the physical page number
+// would be, and the other flags kept, PTE_U among them; see
+// swap.c. one without PTE_U either is a guard page, with no
+// physical page, that nothing may use; see uvmclear().
+#define SWAP2PTE(slot) (((uint64)(slot)) << 10)
+#define PTE2SWAP(pte) ((pte) >> 10)
+#define PTE_SWAPPED(pte) (((pte) & (PTE_V|PTE_U)) == PTE_U)
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
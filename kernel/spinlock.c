@@ -8,7 +8,7 @@
 #include "proc.h"
 #include "defs.h"
 
-#define NLOCK 1000
+#define NLOCK (1000+NBUF)  // every buffer has a sleep lock
 
 static int nlock;
 static struct spinlock *locks[NLOCK];
@@ -96,6 +96,19 @@ holding(struct spinlock *lk)
   return r;
 }
 
+// Whether this CPU holds any spin lock, in
+// which case the caller must not sleep.
+int
+holdingspin(void)
+{
+  int r;
+
+  push_off();
+  r = mycpu()->noff > 1;
+  pop_off();
+  return r;
+}
+
 // push_off/pop_off are like intr_off()/intr_on() except that they are matched:
 // it takes two pop_off()s to undo two push_off()s.  Also, if interrupts
 // are initially off, then push_off, pop_off leaves them off.
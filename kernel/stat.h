@@ -9,3 +9,14 @@ struct stat {
   short nlink; // Number of links to file
   uint64 size; // Size of file in bytes
 };
+
+// Buffer cache statistics, filled in by bcstat().
+struct bcstat {
+  int nbuf;     // Buffers currently in the cache
+  int maxbuf;   // Upper bound on nbuf
+  uint64 hits;  // Lookups that found the block cached
+  uint64 misses; // Lookups that had to read the disk
+  uint64 prefetched; // Blocks read ahead of a sequential reader
+  uint64 rahits;     // Read-ahead blocks later asked for
+  int readahead;     // Maximum read-ahead window, in blocks
+};
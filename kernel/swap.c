@@ -0,0 +1,388 @@
+//
+// Swapping anonymous user pages out to the second disk.
+//
+// When free memory runs low, the kswapd kernel thread runs a
+// clock hand over the user pages of processes, below p->sz:
+// the program, heap and stack, not mmap()ed files. A page the
+// process has used since the hand last came by, as the PTE_A
+// bit says, gets a second chance; any other page that only
+// this process references is written to a free slot of swap
+// space on SWAPDEV and freed. Its PTE is left invalid but not
+// zero, holding the slot number where the physical page number
+// was, so vmfault() knows to read the page back in. A megapage
+// goes out whole, to an aligned run of 512 slots, and comes
+// back a page at a time.
+//
+// kswapd only touches a process that is sleeping or runnable,
+// holding its p->lock so that it can't start running, and not
+// one preempted in the kernel, which may be half-way through
+// changing its own page table. Having changed p's PTEs, it
+// gives p a new ASID rather than flushing TLBs.
+//
+// A process that needs a page when there is none waits, in
+// swapkalloc(), for kswapd to free some.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+
+#define BPP       (PGSIZE/BSIZE)  // disk blocks per page
+#define SWAPREQ   16    // blocks per disk request
+#define SWAPBATCH 32    // pages written out at once
+#define SWAPSCAN  1024  // PTEs the clock hand passes per round
+#define SWAPLOW   256   // wake kswapd below this many free pages
+#define SWAPHIGH  1024  // and let it rest above this many
+#define SWAPPOLL  5     // ticks between kswapd's looks at memory
+
+// states of a swap slot.
+enum { SFREE, SUSED, SWRITING, SFREEING };
+
+extern struct proc proc[NPROC];
+
+struct {
+  struct spinlock lock;
+  uchar state[NSWAP];
+  int nfree;       // slots in state SFREE
+  int hint;        // where to start looking for a free slot
+  int started;     // reclaim rounds started ...
+  int done;        // ... and finished
+  int freed;       // pages the last round freed
+  int want;        // a process is waiting; protected by tickslock
+  int hand;        // clock hand: process ...
+  uint64 handva;   // ... and address; only used by kswapd
+} swap;
+
+// for swapout(), which only kswapd calls.
+static struct buf outbufs[SWAPBATCH*BPP];
+
+static void kswapd(void*);
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  swap.nfree = NSWAP;
+  virtio_disk_init(SWAPDEV);
+  if(kthread(kswapd, 0, "kswapd") < 0)
+    panic("swapinit: kswapd");
+}
+
+// The number of free pages of swap space.
+// Read without the lock, so only an estimate.
+int
+swappages(void)
+{
+  return swap.nfree;
+}
+
+// Take n free slots, n being 1 or a megapage's worth of
+// pages, which are consecutive and aligned to n. They start
+// out being written. returns the first, or -1 if swap space
+// is full.
+static int
+swapalloc(int n)
+{
+  int i, j, slot;
+
+  acquire(&swap.lock);
+  for(i = 0; i < NSWAP; i += n){
+    slot = (swap.hint + i) % NSWAP;
+    slot -= slot % n;
+    for(j = 0; j < n; j++)
+      if(swap.state[slot+j] != SFREE)
+        break;
+    if(j < n)
+      continue;
+    for(j = 0; j < n; j++)
+      swap.state[slot+j] = SWRITING;
+    swap.nfree -= n;
+    swap.hint = (slot + n) % NSWAP;
+    release(&swap.lock);
+    return slot;
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Give back n slots starting at slot, whose pages are no
+// longer wanted. A slot still being written is freed when
+// the write finishes.
+void
+swapfree(uint64 slot, int n)
+{
+  int i;
+
+  if(slot + n > NSWAP)
+    panic("swapfree");
+  acquire(&swap.lock);
+  for(i = 0; i < n; i++){
+    if(swap.state[slot+i] == SWRITING){
+      swap.state[slot+i] = SFREEING;
+    } else if(swap.state[slot+i] == SUSED){
+      swap.state[slot+i] = SFREE;
+      swap.nfree++;
+    } else {
+      panic("swapfree: free");
+    }
+  }
+  release(&swap.lock);
+}
+
+// The n slots starting at slot have been written.
+static void
+swapwritten(int slot, int n)
+{
+  int i;
+
+  acquire(&swap.lock);
+  for(i = 0; i < n; i++){
+    if(swap.state[slot+i] == SFREEING){
+      swap.state[slot+i] = SFREE;
+      swap.nfree++;
+    } else {
+      swap.state[slot+i] = SUSED;
+    }
+  }
+  release(&swap.lock);
+  // not under swap.lock: swapscan() takes it holding p->lock.
+  wakeup(&swap.state);
+}
+
+// Read or write npages pages at pa from or to swap, starting
+// at slot, and wait for the disk. bufs has room for a buf per
+// block; they are private to the caller, so unlike the buffer
+// cache's they aren't locked.
+static void
+swapio(uint64 slot, char *pa, int npages, int write, struct buf *bufs)
+{
+  struct buf *bs[SWAPREQ];
+  int i, j, n, nb;
+
+  nb = npages * BPP;
+  for(i = 0; i < nb; i++){
+    bufs[i].dev = SWAPDEV;
+    bufs[i].blockno = slot*BPP + i;
+    bufs[i].data = (uchar*)pa + i*BSIZE;
+  }
+  for(i = 0; i < nb; i += n){
+    n = nb - i;
+    if(n > SWAPREQ)
+      n = SWAPREQ;
+    for(j = 0; j < n; j++)
+      bs[j] = &bufs[i+j];
+    virtio_disk_start(SWAPDEV, bs, n, write);
+  }
+  for(i = 0; i < nb; i++)
+    virtio_disk_wait(SWAPDEV, &bufs[i]);
+}
+
+// Read the page in slot into mem, waiting first
+// if it is still being written out. Sleeps, so
+// the caller must not hold a spin lock.
+void
+swapread(uint64 slot, char *mem)
+{
+  struct buf bufs[BPP];
+
+  if(holdingspin())
+    panic("swapread: locked");
+
+  acquire(&swap.lock);
+  while(swap.state[slot] == SWRITING)
+    sleep(&swap.state, &swap.lock);
+  release(&swap.lock);
+  swapio(slot, mem, 1, 0, bufs);
+}
+
+// Write npages pages at pa out to the slots from slot on.
+static void
+swapout(int slot, char *pa, int npages)
+{
+  int i, n;
+
+  for(i = 0; i < npages; i += n){
+    n = npages - i;
+    if(n > SWAPBATCH)
+      n = SWAPBATCH;
+    swapio(slot + i, pa + i*PGSIZE, n, 1, outbufs);
+  }
+  swapwritten(slot, npages);
+}
+
+// Move the clock hand over p's pages, from swap.handva up,
+// until the round has passed SWAPSCAN PTEs in all, counted
+// in *scanned, or SWAPBATCH pages or megapages are chosen.
+// Write those out and free them.
+// returns the number of pages freed.
+static int
+swapscan(struct proc *p, int *scanned)
+{
+  struct {
+    char *pa;
+    int slot;
+    int n;
+  } out[SWAPBATCH];
+  pte_t *pte;
+  uint64 va;
+  int i, n, nout, slot, freed, ok;
+
+  nout = 0;
+  va = swap.handva;
+  acquire(&p->lock);
+  ok = (p->state == SLEEPING || p->state == RUNNABLE) &&
+       p->kfn == 0 && p->kpreempt == 0;
+  if(ok){
+    for(; va < p->sz && nout < SWAPBATCH && *scanned < SWAPSCAN; va += PGSIZE){
+      if((pte = walk(p->pagetable, va, 0)) == 0){
+        va |= MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      n = (*pte & PTE_MEGA) ? MEGAPGSIZE/PGSIZE : 1;
+      if(n > 1)
+        va |= MEGAPGSIZE - PGSIZE;
+      if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+        continue;
+      (*scanned)++;
+      // shared pages, copy-on-write or from the
+      // page cache, stay.
+      if(krefcnt((void*)PTE2PA(*pte)) != 1)
+        continue;
+      if(*pte & PTE_A){
+        *pte &= ~PTE_A;
+        continue;
+      }
+      if((slot = swapalloc(n)) < 0)
+        continue;
+      out[nout].pa = (char*)PTE2PA(*pte);
+      out[nout].slot = slot;
+      out[nout].n = n;
+      nout++;
+      *pte = SWAP2PTE(slot) | (PTE_FLAGS(*pte) & ~(PTE_V|PTE_A|PTE_D));
+    }
+    // p's TLB entries may still map the pages.
+    if(nout > 0)
+      p->asid = 0;
+  }
+  if(ok && va < p->sz){
+    swap.handva = va;
+  } else {
+    swap.hand = (swap.hand + 1) % NPROC;
+    swap.handva = 0;
+  }
+  release(&p->lock);
+
+  freed = 0;
+  for(i = 0; i < nout; i++){
+    swapout(out[i].slot, out[i].pa, out[i].n);
+    if(out[i].n > 1)
+      kfreemega(out[i].pa);
+    else
+      kfree(out[i].pa);
+    freed += out[i].n;
+  }
+  return freed;
+}
+
+// One round of reclaim: run the clock hand until it has passed
+// SWAPSCAN PTEs or freed SWAPBATCH pages, but at most twice
+// around the process table, so that a round can finish even
+// when there are few pages to look at.
+// returns the number of pages freed.
+static int
+reclaim(void)
+{
+  int i, scanned, freed;
+
+  scanned = 0;
+  freed = 0;
+  for(i = 0; i < 2*NPROC && scanned < SWAPSCAN && freed < SWAPBATCH; i++)
+    freed += swapscan(&proc[swap.hand], &scanned);
+  return freed;
+}
+
+// The pages that could be had right away.
+static int
+available(void)
+{
+  return kfreepages() + pcpages();
+}
+
+// kswapd: wake up every SWAPPOLL ticks to see whether memory
+// is low, or sooner if a process is waiting in swapwait(),
+// and if so reclaim until it no longer is, or nothing more
+// will go.
+static void
+kswapd(void *arg)
+{
+  int n;
+
+  for(;;){
+    acquire(&tickslock);
+    while(swap.want == 0 && available() >= SWAPLOW)
+      sleeptimeout(&swap.want, &tickslock, SWAPPOLL);
+    swap.want = 0;
+    release(&tickslock);
+
+    do {
+      acquire(&swap.lock);
+      swap.started++;
+      release(&swap.lock);
+
+      n = reclaim();
+
+      acquire(&swap.lock);
+      swap.done++;
+      swap.freed = n;
+      release(&swap.lock);
+      wakeup(&swap.done);
+    } while(n > 0 && available() < SWAPHIGH);
+  }
+}
+
+// Wait for a round of reclaim that starts after now.
+// returns 0 if it freed something, -1 if not.
+static int
+swapwait(void)
+{
+  int target, r;
+
+  acquire(&swap.lock);
+  target = swap.started + 1;
+  release(&swap.lock);
+
+  acquire(&tickslock);
+  swap.want = 1;
+  wakeup(&swap.want);
+  release(&tickslock);
+
+  acquire(&swap.lock);
+  while(swap.done < target)
+    sleep(&swap.done, &swap.lock);
+  r = swap.freed > 0 ? 0 : -1;
+  release(&swap.lock);
+  return r;
+}
+
+// Allocate a page for user memory like kalloc(), but when
+// memory has run out, wait for kswapd to swap some out.
+// Gives up, returning 0, if kswapd can't, or if the caller
+// holds a spin lock and so can't wait.
+void*
+swapkalloc(void)
+{
+  void *mem;
+
+  while((mem = kalloc()) == 0){
+    if(holdingspin() || myproc() == 0 || myproc()->kfn || swapwait() < 0)
+      return 0;
+  }
+  return mem;
+}
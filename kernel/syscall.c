@@ -105,6 +105,14 @@ extern uint64 sys_wait(void);
 extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
 extern uint64 sys_ntas(void);
+extern uint64 sys_bcstat(void);
+extern uint64 sys_readahead(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_nice(void);
+extern uint64 sys_nanotime(void);
+extern uint64 sys_nanosleep(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -129,6 +137,14 @@ static uint64 (*syscalls[])(void) = {
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
 [SYS_ntas]    sys_ntas,
+[SYS_bcstat]  sys_bcstat,
+[SYS_readahead] sys_readahead,
+[SYS_fsync]   sys_fsync,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_nice]    sys_nice,
+[SYS_nanotime]  sys_nanotime,
+[SYS_nanosleep] sys_nanosleep,
 };
 
 void
@@ -23,3 +23,11 @@
 
 // System calls for labs
 #define SYS_ntas   22
+#define SYS_bcstat 23
+#define SYS_readahead 24
+#define SYS_fsync  25
+#define SYS_mmap   26
+#define SYS_munmap 27
+#define SYS_nice   28
+#define SYS_nanotime  29
+#define SYS_nanosleep 30
@@ -125,7 +125,7 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op(ROOTDEV);
+  begin_opn(ROOTDEV, DIROPBLOCKS);
   if((ip = namei(old)) == 0){
     end_op(ROOTDEV);
     return -1;
@@ -165,21 +165,6 @@ bad:
   return -1;
 }
 
-// Is the directory dp empty except for "." and ".." ?
-static int
-isdirempty(struct inode *dp)
-{
-  int off;
-  struct dirent de;
-
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("isdirempty: readi");
-    if(de.inum != 0)
-      return 0;
-  }
-  return 1;
-}
 
 uint64
 sys_unlink(void)
@@ -210,7 +195,7 @@ sys_unlink(void)
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  if(ip->type == T_DIR && !dirempty(ip)){
     iunlockput(ip);
     goto bad;
   }
@@ -275,8 +260,18 @@ create(char *path, short type, short major, short minor)
       panic("create dots");
   }
 
-  if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+  if(dirlink(dp, name, ip->inum) < 0){
+    // dp is full; undo.
+    if(type == T_DIR){
+      dp->nlink--;
+      iupdate(dp);
+    }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
 
   iunlockput(dp);
 
@@ -295,7 +290,7 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  begin_op(ROOTDEV);
+  begin_opn(ROOTDEV, (omode & O_CREATE) ? DIROPBLOCKS : MAXOPBLOCKS);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -339,6 +334,9 @@ sys_open(void)
   }
   f->ip = ip;
   f->off = 0;
+  f->ranext = 0;
+  f->rawin = 0;
+  f->raend = 0;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
 
@@ -354,7 +352,7 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op(ROOTDEV);
+  begin_opn(ROOTDEV, DIROPBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op(ROOTDEV);
     return -1;
@@ -371,7 +369,7 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op(ROOTDEV);
+  begin_opn(ROOTDEV, DIROPBLOCKS);
   if((argstr(0, path, MAXPATH)) < 0 ||
      argint(1, &major) < 0 ||
      argint(2, &minor) < 0 ||
@@ -483,3 +481,75 @@ sys_pipe(void)
   return 0;
 }
 
+
+uint64
+sys_bcstat(void)
+{
+  uint64 addr; // user pointer to struct bcstat
+  struct bcstat st;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  bstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// Set the largest read-ahead window to n blocks; 0 turns
+// read-ahead off, and n < 0 leaves it alone.
+// Returns the old window.
+uint64
+sys_readahead(void)
+{
+  int n, old;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  old = readahead;
+  if(n >= 0)
+    readahead = n > RAMAX ? RAMAX : n;
+  return old;
+}
+
+// Wait until everything written so far to the file
+// system holding fd's inode is on disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_INODE && f->type != FD_DEVICE)
+    return -1;
+  log_sync(f->ip->dev);
+  return 0;
+}
+
+uint64
+sys_mmap(void)
+{
+  struct file *f;
+  uint64 addr;
+  int len, prot, flags, off;
+
+  // addr is only a hint, and is ignored.
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(len <= 0 || off < 0)
+    return -1;
+  return mmap(len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  return munmap(addr, len);
+}
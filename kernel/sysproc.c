@@ -67,7 +67,7 @@ sys_sleep(void)
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    sleeptimeout(&ticks, &tickslock, n - (ticks - ticks0));
   }
   release(&tickslock);
   return 0;
@@ -83,6 +83,18 @@ sys_kill(void)
   return kill(pid);
 }
 
+// set the scheduling priority level of a process;
+// see setnice().
+uint64
+sys_nice(void)
+{
+  int pid, n;
+
+  if(argint(0, &pid) < 0 || argint(1, &n) < 0)
+    return -1;
+  return setnice(pid, n);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -95,3 +107,42 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+#define NSPERCYCLE (1000000000L/CLINT_HZ)
+
+// the time since boot, in nanoseconds,
+// from the CLINT rather than in ticks.
+uint64
+sys_nanotime(void)
+{
+  uint64 addr, ns;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  ns = clocknow() * NSPERCYCLE;
+  if(copyout(myproc()->pagetable, addr, (char *)&ns, sizeof(ns)) < 0)
+    return -1;
+  return 0;
+}
+
+// like sleep(), but for n nanoseconds, rounded
+// up to the CLINT's cycles rather than to ticks.
+uint64
+sys_nanosleep(void)
+{
+  uint64 n, when;
+
+  if(argaddr(0, &n) < 0)
+    return -1;
+  when = clocknow() + (n + NSPERCYCLE - 1) / NSPERCYCLE;
+  acquire(&tickslock);
+  while(clocknow() < when){
+    if(myproc()->killed){
+      release(&tickslock);
+      return -1;
+    }
+    sleepuntil(&ticks, &tickslock, when);
+  }
+  release(&tickslock);
+  return 0;
+}
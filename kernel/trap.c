@@ -11,13 +11,20 @@ uint ticks;
 
 extern char trampoline[], uservec[], userret[];
 
+// in ucopy.S.
+extern char ucopybegin[], ucopyend[], ufault[];
+
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
 extern int devintr();
+static int timerintr(void);
+
+#define TICKCYCLES (CLINT_HZ/10)  // CLINT cycles per clock tick
 
 static const char *
 scause_desc(uint64 stval);
+static int ucopyfault(struct proc*, uint64, uint64, uint64);
 
 void
 trapinit(void)
@@ -25,11 +32,36 @@ trapinit(void)
   initlock(&tickslock, "time");
 }
 
-// set up to take exceptions and traps while in the kernel.
+// set up to take exceptions and traps while in the kernel,
+// and start this CPU's clock ticks.
 void
 trapinithart(void)
 {
   w_stvec((uint64)kernelvec);
+  mycpu()->nexttick = clocknow() + TICKCYCLES;
+  clockarm(0);
+}
+
+// The CLINT's time, in cycles since boot.
+uint64
+clocknow(void)
+{
+  return *(volatile uint64*)KCLINT_MTIME;
+}
+
+// Set this CPU's timer to go off at its next tick, or at
+// cycle when, if that isn't 0 and is sooner. timervec in
+// kernelvec.S quiets the timer when it goes off, so it must
+// be set again each time. Must be called with interrupts
+// off, so that the CPU doesn't change.
+void
+clockarm(uint64 when)
+{
+  struct cpu *c = mycpu();
+
+  if(when == 0 || when > c->nexttick)
+    when = c->nexttick;
+  *(volatile uint64*)KCLINT_MTIMECMP(cpuid()) = when;
 }
 
 //
@@ -70,6 +102,11 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            (tlbstale(p, r_stval(), r_scause()) ||
+             vmfault(p, r_stval(), r_scause() == 15) == 0)){
+    // page fault on a lazily allocated or copy-on-write page,
+    // or through a stale TLB entry
   } else {
     printf("usertrap(): unexpected scause %p (%s) pid=%d\n", r_scause(), scause_desc(r_scause()), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -79,8 +116,8 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if the scheduler says so.
+  if(which_dev && schedintr(which_dev))
     yield();
 
   usertrapret();
@@ -103,7 +140,8 @@ usertrapret(void)
 
   // set up trapframe values that uservec will need when
   // the process next re-enters the kernel.
-  p->tf->kernel_satp = r_satp();         // kernel page table
+  uint64 asid = procasid(p);
+  p->tf->kernel_satp = MAKE_SATP(p->kpagetable, asid); // kernel page table
   p->tf->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->tf->kernel_trap = (uint64)usertrap;
   p->tf->kernel_hartid = r_tp();         // hartid for cpuid()
@@ -120,8 +158,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->tf->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // tagged with the process's ASID.
+  uint64 satp = MAKE_SATP(p->pagetable, asid);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -145,15 +184,26 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if((scause == 13 || scause == 15) &&
+     sepc >= (uint64)ucopybegin && sepc < (uint64)ucopyend){
+    // copyin() or copyout() touched user memory that
+    // is not there yet, or is copy-on-write.
+    if(ucopyfault(myproc(), r_stval(), scause, sstatus) < 0)
+      sepc = (uint64)ufault;
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p (%s)\n", scause, scause_desc(scause));
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // give up the CPU if the scheduler says so.
+  // kswapd leaves a process preempted here alone.
+  if(which_dev && myproc() != 0 && myproc()->state == RUNNING &&
+     schedintr(which_dev)){
+    myproc()->kpreempt = 1;
     yield();
+    myproc()->kpreempt = 0;
+  }
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -161,13 +211,42 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Handle a page fault at va taken by ucopy() or ucopystr()
+// for process p, the way usertrap() would have had p made
+// the access itself. returns 0, or -1 if the copy must fail.
+static int
+ucopyfault(struct proc *p, uint64 va, uint64 scause, uint64 sstatus)
+{
+  int r;
+
+  if(p == 0 || va >= MMAPTOP)
+    return -1;
+  if(tlbstale(p, va, scause))
+    return 0;
+  // the copy's caller may hold spin locks, and then
+  // vmfault() mustn't sleep, nor even be tried with
+  // interrupts off; the copy fails.
+  if(holdingspin())
+    return -1;
+  // vmfault() may have to read the disk. let interrupts
+  // in again, if the copy ran with them on.
+  if(sstatus & SSTATUS_SPIE)
+    intr_on();
+  r = vmfault(p, va, scause == 15);
+  intr_off();
+  return r;
+}
+
 void
 clockintr()
 {
   acquire(&tickslock);
   ticks++;
-  wakeup(&ticks);
   release(&tickslock);
+  timerexpire(ticks);
+
+  if(ticks % BOOSTTICKS == 0)
+    schedboost();
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -204,20 +283,41 @@ devintr()
     // software interrupt from a machine-mode timer interrupt,
     // forwarded by timervec in kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
+    // the SSIP bit in sip, before the timer is set again.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    return timerintr();
   } else {
     return 0;
   }
 }
 
+// This CPU's timer has gone off, for a clock tick, a
+// sleepuntil() deadline, or both. Wake the processes whose
+// deadlines have passed, and set the timer for the next.
+// returns 2 if it was a tick, 1 if not.
+static int
+timerintr(void)
+{
+  struct cpu *c = mycpu();
+  uint64 now;
+  int r;
+
+  now = clocknow();
+  r = 1;
+  if(now >= c->nexttick){
+    c->nexttick += TICKCYCLES;
+    if(c->nexttick <= now)
+      c->nexttick = now + TICKCYCLES;
+    if(cpuid() == 0)
+      clockintr();
+    r = 2;
+  }
+  clockarm(clockexpire(now));
+  return r;
+}
+
 static const char *
 scause_desc(uint64 stval)
 {
@@ -34,15 +34,21 @@ struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  int unkicked;    // requests in avail[] not yet announced to the device.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // status is indexed by the first descriptor of a chain,
+  // b by the descriptor that holds the buf's data.
   struct {
     struct buf *b;
     char status;
   } info[NUM];
 
+  // disk command headers.
+  // one-for-one with descriptors, for convenience.
+  struct virtio_blk_outhdr ops[NUM];
+
   // initialized?
   int init;
 
@@ -163,10 +169,11 @@ free_chain(int n, int i)
   }
 }
 
+// allocate cnt descriptors, all or none.
 static int
-alloc3_desc(int n, int *idx)
+allocn_desc(int n, int *idx, int cnt)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < cnt; i++){
     idx[i] = alloc_desc(n);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -177,67 +184,91 @@ alloc3_desc(int n, int *idx)
   return 0;
 }
 
+// tell the device about requests added to avail[]
+// since the last kick. caller must hold vdisk_lock.
+static void
+kick(int n)
+{
+  if(disk[n].unkicked == 0)
+    return;
+  __sync_synchronize();
+  *R(n, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  disk[n].unkicked = 0;
+}
+
+// queue a request to read or write the nb buffers in bs[],
+// which must hold consecutive blocks, as one disk operation.
+// don't tell the device yet; see virtio_disk_kick(). the caller
+// must hold each buffer's sleep lock, and must later wait with
+// virtio_disk_wait() before using or releasing it.
 void
-virtio_disk_rw(int n, struct buf *b, int write)
+virtio_disk_start(int n, struct buf **bs, int nb, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
+  int idx[NUM];
+  int i;
+
+  if(nb < 1 || nb > NUM-2)
+    panic("virtio_disk_start");
 
   acquire(&disk[n].vdisk_lock);
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+  // the spec says that legacy block operations use at least
+  // three descriptors: one for type/reserved/sector, one or
+  // more for the data, one for a 1-byte status result.
+  // we use one data descriptor per buffer.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors. if the ring is full,
+  // make sure the device knows about what we have queued,
+  // so that descriptors will be freed.
   while(1){
-    if(alloc3_desc(n, idx) == 0) {
+    if(allocn_desc(n, idx, nb+2) == 0) {
       break;
     }
+    kick(n);
     sleep(&disk[n].free[0], &disk[n].vdisk_lock);
   }
   
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  struct virtio_blk_outhdr *buf0 = &disk[n].ops[idx[0]];
 
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk[n].desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk[n].desc[idx[0]].len = sizeof(buf0);
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  disk[n].desc[idx[0]].addr = (uint64) buf0;
+  disk[n].desc[idx[0]].len = sizeof(*buf0);
   disk[n].desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk[n].desc[idx[0]].next = idx[1];
 
-  disk[n].desc[idx[1]].addr = (uint64) b->data;
-  disk[n].desc[idx[1]].len = BSIZE;
-  if(write)
-    disk[n].desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk[n].desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk[n].desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk[n].desc[idx[1]].next = idx[2];
+  for(i = 1; i <= nb; i++){
+    struct buf *b = bs[i-1];
+    if(b->blockno != bs[0]->blockno + i-1)
+      panic("virtio_disk_start: not consecutive");
+    disk[n].desc[idx[i]].addr = (uint64) b->data;
+    disk[n].desc[idx[i]].len = BSIZE;
+    if(write)
+      disk[n].desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk[n].desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk[n].desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk[n].desc[idx[i]].next = idx[i+1];
 
-  disk[n].info[idx[0]].status = 0;
-  disk[n].desc[idx[2]].addr = (uint64) &disk[n].info[idx[0]].status;
-  disk[n].desc[idx[2]].len = 1;
-  disk[n].desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk[n].desc[idx[2]].next = 0;
+    // record struct buf for virtio_disk_intr().
+    b->disk = 1;
+    disk[n].info[idx[i]].b = b;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk[n].info[idx[0]].b = b;
+  disk[n].info[idx[0]].status = 0xff; // device writes 0 on success
+  disk[n].desc[idx[nb+1]].addr = (uint64) &disk[n].info[idx[0]].status;
+  disk[n].desc[idx[nb+1]].len = 1;
+  disk[n].desc[idx[nb+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk[n].desc[idx[nb+1]].next = 0;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
@@ -246,37 +277,78 @@ virtio_disk_rw(int n, struct buf *b, int write)
   disk[n].avail[2 + (disk[n].avail[1] % NUM)] = idx[0];
   __sync_synchronize();
   disk[n].avail[1] = disk[n].avail[1] + 1;
+  disk[n].unkicked++;
 
-  *R(n, VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  release(&disk[n].vdisk_lock);
+}
+
+// tell the device to start on the requests queued
+// by virtio_disk_start().
+void
+virtio_disk_kick(int n)
+{
+  acquire(&disk[n].vdisk_lock);
+  kick(n);
+  release(&disk[n].vdisk_lock);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
+// wait for virtio_disk_intr() to say the request
+// for b has finished.
+void
+virtio_disk_wait(int n, struct buf *b)
+{
+  acquire(&disk[n].vdisk_lock);
+  kick(n);
   while(b->disk == 1) {
     sleep(b, &disk[n].vdisk_lock);
   }
-
-  disk[n].info[idx[0]].b = 0;
-  free_chain(n, idx[0]);
-
   release(&disk[n].vdisk_lock);
 }
 
+void
+virtio_disk_rw(int n, struct buf *b, int write)
+{
+  virtio_disk_start(n, &b, 1, write);
+  virtio_disk_wait(n, b);
+}
+
 void
 virtio_disk_intr(int n)
 {
   acquire(&disk[n].vdisk_lock);
 
+  // the device won't raise another interrupt until we tell it
+  // we've seen this one, which the following line does.
+  // this may race with the device writing new entries to
+  // the "used" ring, in which case we may process the new
+  // completion entries in this interrupt, and have nothing to do
+  // in the next interrupt, which is harmless.
+  *R(n, VIRTIO_MMIO_INTERRUPT_ACK) = *R(n, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+  __sync_synchronize();
+
+  // reap every completed request: wake up whoever is waiting
+  // for each of its bufs, and free its descriptors.
   while((disk[n].used_idx % NUM) != (disk[n].used->id % NUM)){
     int id = disk[n].used->elems[disk[n].used_idx].id;
 
     if(disk[n].info[id].status != 0)
       panic("virtio_disk_intr status");
-    
-    disk[n].info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk[n].info[id].b);
+
+    for(int i = id; ; i = disk[n].desc[i].next){
+      struct buf *b = disk[n].info[i].b;
+      if(b){
+        b->disk = 0;   // disk is done with buf
+        wakeup(b);
+        disk[n].info[i].b = 0;
+      }
+      if((disk[n].desc[i].flags & VRING_DESC_F_NEXT) == 0)
+        break;
+    }
+    free_chain(n, id);
 
     disk[n].used_idx = (disk[n].used_idx + 1) % NUM;
   }
 
   release(&disk[n].vdisk_lock);
 }
-
@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -13,10 +15,15 @@ pagetable_t kernel_pagetable;
 
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
+#define TLBFLUSHPAGES 32  // beyond this, uvmflush() flushes a whole ASID
+
 extern char trampoline[]; // trampoline.S
 
 void print(pagetable_t);
 
+static pte_t *walklevel(pagetable_t, uint64, int, int);
+static int uvmswapin(pagetable_t, uint64);
+
 /*
  * create a direct-map page table for the kernel and
  * turn on paging. called early, in supervisor mode.
@@ -37,8 +44,10 @@ kvminit()
   // virtio mmio disk interface 1
   kvmmap(VIRTION(1), VIRTION(1), PGSIZE, PTE_R | PTE_W);
 
-  // CLINT
-  kvmmap(CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+  // CLINT, for reading the time and setting timers.
+  // not at CLINT, which is in the middle of user memory
+  // in processes' kernel page tables.
+  kvmmap(KCLINT, CLINT, 0x10000, PTE_R | PTE_W);
 
   // PLIC
   kvmmap(PLIC, PLIC, 0x400000, PTE_R | PTE_W);
@@ -54,12 +63,41 @@ kvminit()
   kvmmap(TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 }
 
+// Create the kernel page table for a process with user page
+// table upt. It is a copy of the kernel's, except that its
+// first gigabyte of addresses, which holds all of user memory
+// below MMAPTOP and the kernel's devices above it, is the
+// same level-1 page-table page as upt's; see uvmcreate().
+// So the kernel sees user memory at user addresses, and any
+// change to upt shows up in both.
+// returns 0 if out of memory.
+pagetable_t
+kvmcreate(pagetable_t upt)
+{
+  pagetable_t kpt;
+
+  if((kpt = (pagetable_t)kalloc()) == 0)
+    return 0;
+  memmove(kpt, kernel_pagetable, PGSIZE);
+  kpt[0] = upt[0];
+  return kpt;
+}
+
+// Make kernel page table kpt share the user memory of
+// upt instead, for exec(), and forget the old in the TLB.
+void
+kvmsetuser(pagetable_t kpt, pagetable_t upt)
+{
+  kpt[0] = upt[0];
+  sfence_vma();
+}
+
 // Switch h/w page table register to the kernel's page table,
 // and enable paging.
 void
 kvminithart()
 {
-  w_satp(MAKE_SATP(kernel_pagetable));
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
   sfence_vma();
 }
 
@@ -75,16 +113,33 @@ kvminithart()
 //   21..39 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..12 -- 12 bits of byte offset within the page.
-static pte_t *
+//
+// A PTE at level 1 may itself be a leaf, marked PTE_MEGA,
+// that maps a whole 2-megabyte megapage; walk() returns
+// it for any va in the megapage. So it does for one that
+// is out in swap.
+pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but return the PTE at level (0 or 1)
+// rather than descending all the way to level 0.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int last)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
+  for(int level = 2; level > last; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X))
+        return pte;  // a megapage
       pagetable = (pagetable_t)PTE2PA(*pte);
+    } else if(*pte != 0) {
+      return pte;  // a megapage out in swap
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
         return 0;
@@ -92,7 +147,49 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(last, va)];
+}
+
+// The physical address of the page at va,
+// which leaf PTE pte maps.
+static uint64
+pteaddr(pte_t pte, uint64 va)
+{
+  uint64 pa = PTE2PA(pte);
+
+  if(pte & PTE_MEGA)
+    pa += PGROUNDDOWN(va) & (MEGAPGSIZE-1);
+  return pa;
+}
+
+// Replace the megapage leaf *pte by a page-table page
+// of 512 leaves that map the same memory with the same
+// permissions, or, if it is out in swap, the same pages in
+// their swap slots. The new page-table page is table, or, if
+// table is 0, a newly allocated one. The translations
+// don't change, so a TLB entry for the megapage can stay
+// until the caller changes some of them and flushes.
+// returns 0, or -1 if out of memory.
+static int
+megasplit(pte_t *pte, char *table)
+{
+  pagetable_t pt;
+  uint64 pa;
+  int i, perm;
+
+  if(table == 0 && (table = kalloc()) == 0)
+    return -1;
+  pt = (pagetable_t)table;
+  pa = PTE2PA(*pte);
+  perm = PTE_FLAGS(*pte) & ~PTE_MEGA;
+  for(i = 0; i < 512; i++){
+    if(*pte & PTE_V)
+      pt[i] = PA2PTE(pa + i*PGSIZE) | perm;
+    else
+      pt[i] = SWAP2PTE(PTE2SWAP(*pte) + i) | perm;
+  }
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
 }
 
 // Look up a virtual address, return the physical address,
@@ -114,7 +211,7 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = pteaddr(*pte, va);
   return pa;
 }
 
@@ -144,39 +241,55 @@ kvmpa(uint64 va)
     panic("kvmpa");
   if((*pte & PTE_V) == 0)
     panic("kvmpa");
-  pa = PTE2PA(*pte);
+  pa = pteaddr(*pte, va);
   return pa+off;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Wherever va and pa are both aligned to a
+// megapage and the range covers it, a single megapage leaf
+// maps it. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
-      return -1;
-    if(*pte & PTE_V)
-      panic("remap");
-    *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 &&
+       last - a >= MEGAPGSIZE - PGSIZE){
+      sz = MEGAPGSIZE;
+      if((pte = walklevel(pagetable, a, 1, 1)) == 0)
+        return -1;
+      if(*pte != 0)
+        panic("remap");
+      *pte = PA2PTE(pa) | perm | PTE_V | PTE_MEGA;
+    } else {
+      sz = PGSIZE;
+      if((pte = walk(pagetable, a, 1)) == 0)
+        return -1;
+      if(*pte != 0)
+        panic("remap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+    }
+    if(a + sz - PGSIZE == last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += sz;
+    pa += sz;
   }
   return 0;
 }
 
-// Remove mappings from a page table. The mappings in
-// the given range must exist. Optionally free the
-// physical memory.
+// Remove mappings from a page table. Pages in
+// the given range that were never touched are
+// skipped. Optionally free the physical memory.
+// A megapage that is only partly in the range is
+// split first. Pages out in swap give back their
+// swap slots.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
 {
@@ -186,36 +299,80 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 size, int do_free)
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
-  for(;;){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  for(; a <= last; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) == 0){
+      // no page-table page, so nothing is mapped
+      // up to the next 2-megabyte boundary.
+      a |= MEGAPGSIZE - PGSIZE;
+      continue;
+    }
     if((*pte & PTE_V) == 0){
-      printf("va=%p pte=%p\n", a, *pte);
-      panic("uvmunmap: not mapped");
+      if(!PTE_SWAPPED(*pte)){
+        *pte = 0;  // empty, or a guard page
+        continue;
+      }
+      if(*pte & PTE_MEGA){
+        if(a % MEGAPGSIZE == 0 && last - a >= MEGAPGSIZE - PGSIZE){
+          swapfree(PTE2SWAP(*pte), MEGAPGSIZE/PGSIZE);
+          *pte = 0;
+          a += MEGAPGSIZE - PGSIZE;
+          continue;
+        }
+        if(megasplit(pte, 0) < 0)
+          panic("uvmunmap: split");
+        pte = walk(pagetable, a, 0);
+      }
+      swapfree(PTE2SWAP(*pte), 1);
+      *pte = 0;
+      continue;
     }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(*pte & PTE_MEGA){
+      if(a % MEGAPGSIZE == 0 && last - a >= MEGAPGSIZE - PGSIZE){
+        if(do_free)
+          kfreemega((void*)PTE2PA(*pte));
+        *pte = 0;
+        a += MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      // the page at a is going away, so it can
+      // become the new page-table page.
+      pa = pteaddr(*pte, a);
+      if(megasplit(pte, do_free ? (char*)pa : 0) < 0)
+        panic("uvmunmap: split");
+      pte = walk(pagetable, a, 0);
+      if(do_free){
+        *pte = 0;
+        continue;
+      }
+    }
     if(do_free){
       pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
     *pte = 0;
-    if(a == last)
-      break;
-    a += PGSIZE;
-    pa += PGSIZE;
   }
+  uvmflush(pagetable, va, size);
 }
 
 // create an empty user page table.
 pagetable_t
 uvmcreate()
 {
-  pagetable_t pagetable;
+  pagetable_t pagetable, l1;
   pagetable = (pagetable_t) kalloc();
-  if(pagetable == 0)
+  l1 = (pagetable_t) kalloc();
+  if(pagetable == 0 || l1 == 0)
     panic("uvmcreate: out of memory");
   memset(pagetable, 0, PGSIZE);
+
+  // the first gigabyte gets the kernel's device mappings,
+  // which lack PTE_U, so that the process's kernel page
+  // table can use this part of it as is. uvmfree() leaves
+  // them alone.
+  memmove(l1, (void*)PTE2PA(kernel_pagetable[0]), PGSIZE);
+  pagetable[0] = PA2PTE(l1) | PTE_V;
   return pagetable;
 }
 
@@ -306,47 +463,390 @@ freewalk(pagetable_t pagetable)
 void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
+  pagetable_t l1;
+
   uvmunmap(pagetable, 0, sz, 1);
+
+  // the device mappings belong to the kernel.
+  l1 = (pagetable_t)PTE2PA(pagetable[0]);
+  for(int i = PX(1, MMAPTOP); i < 512; i++)
+    l1[i] = 0;
   freewalk(pagetable);
 }
 
+// Map the pages of old in [va, va+len) into new
+// at the same addresses, sharing the physical pages.
+// If cow is set, writable pages become read-only
+// copy-on-write pages in both page tables.
+// Pages that were never touched stay unmapped, guard
+// pages are copied, and pages out in swap are read back
+// in to be shared.
+// returns 0 on success, -1 on failure.
+// unmaps what it mapped in new on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int cow)
+{
+  pte_t *pte, *npte;
+  uint64 pa, i;
+  uint flags;
+
+  for(i = va; i < va + len; i += PGSIZE){
+    if((pte = walk(old, i, 0)) == 0){
+      i |= MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if((*pte & PTE_V) == 0){
+      if(*pte == 0)
+        continue;
+      if(!PTE_SWAPPED(*pte)){
+        if((npte = walk(new, i, 1)) == 0)
+          goto err;
+        *npte = *pte;
+        continue;
+      }
+      if(uvmswapin(old, i) < 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if(*pte & PTE_MEGA){
+      // pages are shared and counted one by one.
+      if(megasplit(pte, 0) < 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+    pa = PTE2PA(*pte);
+    flags = PTE_FLAGS(*pte);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
+      goto err;
+    krefinc((void*)pa);
+  }
+  // old's writable pages may now be read-only.
+  uvmflush(old, va, len);
+  return 0;
+
+ err:
+  if(i > va)
+    uvmunmap(new, va, i - va, 1);
+  uvmflush(old, va, len);
+  return -1;
+}
+
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: the child shares
+// the parent's physical pages, and writable pages
+// become read-only copy-on-write pages in both.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Give the process its own writable copy of the
+// copy-on-write page containing va, after a write
+// fault or before copyout() writes to it.
+// If no one else shares the page any more, it is
+// simply made writable again.
+// returns 0 on success, -1 if va is not a
+// copy-on-write user page or memory ran out.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa, i;
+  uint64 pa;
   uint flags;
   char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
-    pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcnt((void*)pa) == 1){
+    // the other sharers have gone; no one else
+    // can gain a reference, so no copy is needed.
+    *pte = PA2PTE(pa) | flags;
+  } else {
     if((mem = kalloc()) == 0)
-      goto err;
+      return -1;
     memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
+    *pte = PA2PTE(mem) | flags;
+    kfree((void*)pa);
+  }
+  uvmflush(pagetable, va, PGSIZE);
+  return 0;
+}
+
+// Make the TLB forget what it may hold of [va, va+len)
+// in pagetable, whose PTEs there have been removed or
+// changed. Only the current process's page table needs
+// this: the TLB entries of any other are tagged with an
+// ASID that won't be reused until every TLB is flushed.
+void
+uvmflush(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 a, asid;
+
+  if(p == 0 || pagetable != p->pagetable)
+    return;
+
+  push_off();
+  // the ASID this CPU runs p with, or 0 if there are none.
+  asid = (r_satp() >> SATP_ASIDSHIFT) & SATP_ASIDMASK;
+  if(asid != 0 && (p->tlbcpus & ~(1 << cpuid()))){
+    // other CPUs' TLBs may hold entries. rather than
+    // make them flush, give p a new ASID when it next
+    // runs. until then this CPU goes on using the old
+    // one, in the kernel.
+    p->asid = 0;
+    sfence_vma_asid(asid);
+  } else if(len > TLBFLUSHPAGES*PGSIZE){
+    sfence_vma_asid(asid);
+  } else {
+    for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+      sfence_vma_page(a, asid);
+  }
+  pop_off();
+}
+
+// Whether a user page fault with cause scause at va
+// came from a stale TLB entry, the PTE allowing the
+// access: a TLB may remember that a page was not
+// mapped. If so, flush this CPU's entry for va.
+int
+tlbstale(struct proc *p, uint64 va, uint64 scause)
+{
+  pte_t *pte;
+  int perm;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(p->pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+    return 0;
+  perm = scause == 12 ? PTE_X : scause == 13 ? PTE_R : PTE_W;
+  if((*pte & perm) == 0)
+    return 0;
+  sfence_vma_page(PGROUNDDOWN(va), (r_satp() >> SATP_ASIDSHIFT) & SATP_ASIDMASK);
+  return 1;
+}
+
+// Whether a heap fault at va in p can be handled by
+// mapping the whole megapage around it: the megapage
+// lies below p->sz, nothing in it is mapped yet, and
+// no program segment overlaps it.
+static int
+megaok(struct proc *p, uint64 va)
+{
+  uint64 a = MEGAPGROUNDDOWN(va);
+  struct seg *s;
+
+  if(a + MEGAPGSIZE > p->sz)
+    return 0;
+  if(walk(p->pagetable, a, 0) != 0)
+    return 0;
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    if(s->va < a + MEGAPGSIZE && a < s->va + s->memsz)
+      return 0;
+  return 1;
+}
+
+// Read the page at va in pagetable, which is out in swap,
+// back into a page of its own. A megapage that went out
+// whole comes back a page at a time. Sleeps, so it fails
+// if the caller holds a spin lock, which must release it
+// and try again.
+// returns 0, or -1 if out of memory or a spin lock is held.
+static int
+uvmswapin(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 slot;
+  char *mem;
+
+  if(holdingspin())
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(*pte & PTE_MEGA){
+    if((mem = swapkalloc()) == 0)
+      return -1;
+    megasplit(pte, mem);
+    pte = walk(pagetable, va, 0);
+  }
+  if((mem = swapkalloc()) == 0)
+    return -1;
+  // no spin lock is held, so sleeping here is safe; and
+  // only this process changes PTEs of pages out in swap,
+  // so *pte is the same after sleeping.
+  slot = PTE2SWAP(*pte);
+  swapread(slot, mem);
+  *pte = PA2PTE(mem) | PTE_FLAGS(*pte) | PTE_V;
+  swapfree(slot, 1);
+  return 0;
+}
+
+// Read back in from swap any pages of pagetable below sz
+// that are out there, so that uvmcopy() won't have to,
+// holding the new process's lock. Only the current
+// process, which kswapd leaves alone while it runs, can
+// rely on them staying in.
+// returns 0, or -1 if out of memory.
+int
+uvmswapinall(pagetable_t pagetable, uint64 sz)
+{
+  pte_t *pte;
+  uint64 va;
+
+  for(va = 0; va < sz; va += PGSIZE){
+    if((pte = walk(pagetable, va, 0)) == 0){
+      va |= MEGAPGSIZE - PGSIZE;
+      continue;
     }
+    if((*pte & (PTE_V|PTE_MEGA)) == (PTE_V|PTE_MEGA))
+      va |= MEGAPGSIZE - PGSIZE;
+    else if(PTE_SWAPPED(*pte) && uvmswapin(pagetable, va) < 0)
+      return -1;
   }
   return 0;
+}
 
- err:
-  uvmunmap(new, 0, i, 1);
-  return -1;
+// Handle a page fault at va in process p.
+// A page out in swap is read back in;
+// a page of the program is paged in from its file;
+// a heap page that has never been touched is
+// allocated and zeroed, along with the rest of its
+// megapage if megaok(); a page of an mmap()ed file
+// is mapped; a write to a copy-on-write page gets
+// its own copy.
+// returns 0 if the fault was handled, -1 if the
+// access is illegal, memory ran out, or handling it
+// would sleep while the caller holds a spin lock.
+int
+vmfault(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  char *mem;
+  int r;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(p->pagetable, va);
+    return -1;
+  }
+  // the rest may sleep, reading the page in or waiting
+  // for memory, which a copyin() or copyout() made
+  // holding a spin lock mustn't; the copy fails instead.
+  if(holdingspin())
+    return -1;
+  if(pte && *pte != 0){
+    if(!PTE_SWAPPED(*pte))
+      return -1;  // a guard page
+    return uvmswapin(p->pagetable, va);
+  }
+  if(va >= p->sz)
+    return mmapfault(p, va, write);
+  if((r = execfault(p, va, write)) <= 0)
+    return r;
+
+  if(megaok(p, va) && (mem = kallocmega()) != 0){
+    memset(mem, 0, MEGAPGSIZE);
+    if(mappages(p->pagetable, MEGAPGROUNDDOWN(va), MEGAPGSIZE, (uint64)mem,
+                PTE_W|PTE_X|PTE_R|PTE_U) == 0)
+      return 0;
+    kfreemega(mem);
+  }
+
+  if((mem = swapkalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fault in the current process's pages in [va, va+len),
+// for writing if write is set, as a copyout() or copyin()
+// there would. fileread() and filewrite() do this before
+// locking the file's inode: paging in an mmap()ed page or a
+// page of the program locks that file's inode, so a copy
+// under one inode's lock to or from another file's pages
+// could deadlock with a process copying the other way.
+// Once in, such pages only go out to swap, if at all.
+// Stops at the first page that can't be faulted in; the
+// copy will fail there.
+void
+uvmprefault(uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint64 a;
+
+  if(va >= MMAPTOP)
+    return;
+  if(len > MMAPTOP - va)
+    len = MMAPTOP - va;
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V) && (!write || (*pte & PTE_W)))
+      continue;
+    if(vmfault(p, a, write) < 0)
+      return;
+  }
 }
 
-// mark a PTE invalid for user access.
+// Look up the user page at va for copyin() and
+// copyout(), first faulting it in as a user access
+// would if it is not there yet or, for a write,
+// is copy-on-write.
+// returns the page's physical address, or 0.
+static uint64
+uvmpage(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    // only the current process pages in on demand.
+    if(p == 0 || pagetable != p->pagetable || vmfault(p, va, write) < 0)
+      return 0;
+    pte = walk(pagetable, va, 0);
+  }
+  if(write && (*pte & PTE_W) == 0){
+    // the kernel writes through the physical address,
+    // so it must break copy-on-write sharing itself.
+    if(uvmcow(pagetable, va) < 0)
+      return 0;
+  }
+  if((*pte & PTE_U) == 0)
+    return 0;
+  if(write)
+    *pte |= PTE_D;  // as the MMU would; see mmap.c
+  return pteaddr(*pte, va);
+}
+
+// make the page at va a guard page, freeing its memory.
+// its PTE is left invalid, so that the kernel can't use
+// it either, when it copies to and from user memory with
+// the process's own addresses, but not zero, so that
+// vmfault() doesn't give it a new page.
 // used by exec for the user stack guard page.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
@@ -354,9 +854,23 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte_t *pte;
   
   pte = walk(pagetable, va, 0);
-  if(pte == 0)
+  if(pte == 0 || (*pte & (PTE_V|PTE_MEGA)) != PTE_V)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  kfree((void*)PTE2PA(*pte));
+  *pte = PTE_FLAGS(*pte) & ~(PTE_V|PTE_U|PTE_A|PTE_D);
+}
+
+// Whether va is in the user memory of the current process,
+// whose page table is pagetable, so that the kernel can
+// use it directly, at the same address; see ucopy.S.
+// Other page tables, such as the one exec() is building,
+// are copied to page by page through walk().
+static int
+uvmdirect(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && pagetable == p->pagetable && va < MMAPTOP;
 }
 
 // Copy from kernel to user.
@@ -367,9 +881,12 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(uvmdirect(pagetable, dstva) && len <= MMAPTOP - dstva)
+    return ucopy((char*)dstva, src, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -392,9 +909,12 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(uvmdirect(pagetable, srcva) && len <= MMAPTOP - srcva)
+    return ucopy(dst, (char*)srcva, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -419,9 +939,16 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if(uvmdirect(pagetable, srcva)){
+    // user memory ends at MMAPTOP.
+    if(max > MMAPTOP - srcva)
+      max = MMAPTOP - srcva;
+    return ucopystr(dst, (char*)srcva, max);
+  }
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog;     // Number of log blocks, header included
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -40,6 +40,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dirappend(uint dir, struct dirent *de);
 
 // convert to intel byte order
 ushort
@@ -90,6 +91,16 @@ main(int argc, char *argv[])
     exit(1);
   }
 
+  // a sixteenth of the disk for the log, as much as
+  // the header block can describe, but at least
+  // room for a few system calls.
+  nlog = FSSIZE / 16;
+  if(nlog > LOGSIZE)
+    nlog = LOGSIZE;
+  if(nlog < MAXOPBLOCKS*3)
+    nlog = MAXOPBLOCKS*3;
+  nlog += 1;
+
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
@@ -155,7 +166,7 @@ main(int argc, char *argv[])
     bzero(&de, sizeof(de));
     de.inum = xshort(inum);
     strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dirappend(rootino, &de);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -166,7 +177,8 @@ main(int argc, char *argv[])
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
+  if(off < BSIZE)
+    off = BSIZE;
   din.size = xint(off);
   winode(rootino, &din);
 
@@ -260,6 +272,51 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the address of block fbn of the file described by
+// *din, allocating it if necessary. The caller must write
+// *din back if it changed.
+uint
+bmap(struct dinode *din, uint fbn)
+{
+  uint indirect[NINDIRECT];
+  uint bn, ind;
+
+  assert(fbn < MAXFILE);
+  if(fbn < NDIRECT){
+    if(xint(din->addrs[fbn]) == 0){
+      din->addrs[fbn] = xint(freeblock++);
+    }
+    return xint(din->addrs[fbn]);
+  }
+  if(fbn < NDIRECT + NINDIRECT){
+    if(xint(din->addrs[NDIRECT]) == 0){
+      din->addrs[NDIRECT] = xint(freeblock++);
+    }
+    rsect(xint(din->addrs[NDIRECT]), (char*)indirect);
+    if(indirect[fbn - NDIRECT] == 0){
+      indirect[fbn - NDIRECT] = xint(freeblock++);
+      wsect(xint(din->addrs[NDIRECT]), (char*)indirect);
+    }
+    return xint(indirect[fbn-NDIRECT]);
+  }
+  bn = fbn - NDIRECT - NINDIRECT;
+  if(xint(din->addrs[NDIRECT+1]) == 0){
+    din->addrs[NDIRECT+1] = xint(freeblock++);
+  }
+  rsect(xint(din->addrs[NDIRECT+1]), (char*)indirect);
+  if(indirect[bn / NINDIRECT] == 0){
+    indirect[bn / NINDIRECT] = xint(freeblock++);
+    wsect(xint(din->addrs[NDIRECT+1]), (char*)indirect);
+  }
+  ind = xint(indirect[bn / NINDIRECT]);
+  rsect(ind, (char*)indirect);
+  if(indirect[bn % NINDIRECT] == 0){
+    indirect[bn % NINDIRECT] = xint(freeblock++);
+    wsect(ind, (char*)indirect);
+  }
+  return xint(indirect[bn % NINDIRECT]);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -267,7 +324,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -275,23 +331,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -303,3 +343,55 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// must match dirhash() in kernel/fs.c.
+uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 0;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h*31 + (uchar)name[i];
+  return h % NDIRBUCKET;
+}
+
+// Add *de to directory dir, the way dirlink() in
+// kernel/fs.c does: in the first block while it has
+// room, and then in the block its name hashes to.
+void
+dirappend(uint dir, struct dirent *de)
+{
+  struct dinode din;
+  struct dirent blk[BSIZE / sizeof(struct dirent)];
+  uint h, x, bn;
+  int p, i;
+
+  rinode(dir, &din);
+  if(xint(din.size) < BSIZE){
+    iappend(dir, de, sizeof(*de));
+    return;
+  }
+  h = dirhash(de->name);
+  for(p = 0; p < DIRPROBE; p++){
+    bn = 1 + (h+p) % NDIRBUCKET;
+    x = bmap(&din, bn);
+    // the directory runs to the end of its last bucket.
+    if(xint(din.size) < (bn+1)*BSIZE)
+      din.size = xint((bn+1)*BSIZE);
+    winode(dir, &din);
+    rsect(x, blk);
+    for(i = 1; i < BSIZE / sizeof(struct dirent); i++){
+      if(blk[i].inum == 0){
+        blk[i] = *de;
+        wsect(x, blk);
+        return;
+      }
+    }
+    blk[0].name[0] = 1;  // spilled
+    wsect(x, blk);
+  }
+  fprintf(stderr, "mkfs: directory full\n");
+  exit(1);
+}
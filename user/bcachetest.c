@@ -69,6 +69,7 @@ test0()
   char dir[2];
   enum { N = 10, NCHILD = 3 };
   int n;
+  struct bcstat st;
 
   dir[0] = '0';
   dir[1] = '\0';
@@ -119,6 +120,10 @@ test0()
     printf("test0: OK\n");
   else
     printf("test0: FAIL\n");
+  if(bcstat(&st) == 0)
+    printf("bcache: %d/%d buffers, %d hits, %d misses, %d/%d read ahead used\n",
+           st.nbuf, st.maxbuf, (int)st.hits, (int)st.misses,
+           (int)st.rahits, (int)st.prefetched);
 }
 
 void test1()
@@ -0,0 +1,72 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Check nanotime() and nanosleep(): the time must never go
+// backwards, must agree with uptime(), and a nanosleep() must
+// never end early. Print how late nanosleep()s of lengths
+// from 10 microseconds to 50 milliseconds wake up on average,
+// which should be far less than the 100 milliseconds of a tick.
+
+#define ROUNDS  20
+#define US      1000L
+#define MS      (1000*US)
+
+uint64 lengths[] = { 10*US, 100*US, 1*MS, 10*MS, 50*MS };
+
+void
+fail(char *what)
+{
+  printf("clocktest: %s\n", what);
+  exit(1);
+}
+
+uint64
+now(void)
+{
+  uint64 t;
+
+  if(nanotime(&t) < 0)
+    fail("nanotime failed");
+  return t;
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint64 t0, t1, late;
+  int i, j, ticks;
+
+  t0 = now();
+  for(i = 0; i < 100000; i++){
+    t1 = now();
+    if(t1 < t0)
+      fail("time went backwards");
+    t0 = t1;
+  }
+
+  ticks = uptime();
+  t0 = now();
+  sleep(10);
+  t1 = now();
+  ticks = uptime() - ticks;
+  if(t1 - t0 < (ticks - 1) * 100*MS || t1 - t0 > (ticks + 1) * 100*MS)
+    fail("nanotime disagrees with uptime");
+
+  for(i = 0; i < sizeof(lengths)/sizeof(lengths[0]); i++){
+    late = 0;
+    for(j = 0; j < ROUNDS; j++){
+      t0 = now();
+      if(nanosleep(lengths[i]) < 0)
+        fail("nanosleep failed");
+      t1 = now();
+      if(t1 - t0 < lengths[i])
+        fail("nanosleep ended early");
+      late += t1 - t0 - lengths[i];
+    }
+    printf("clocktest: nanosleep(%l us) %l us late on average\n",
+           lengths[i] / US, late / ROUNDS / US);
+  }
+  printf("clocktest: OK\n");
+  exit(0);
+}
@@ -0,0 +1,90 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+
+// Time creating, looking up and removing many names in one
+// directory. The names are links to a single file, since the
+// file system has few inodes.
+
+#define N 20000
+
+void
+mkname(char *name, int i)
+{
+  int j;
+
+  name[0] = 'd';
+  for(j = 1; j < 6; j++){
+    name[6-j] = '0' + i % 10;
+    i /= 10;
+  }
+  name[6] = '\0';
+}
+
+void
+fail(char *what, char *name)
+{
+  printf("dirbench: %s %s failed\n", what, name);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  char name[8], path[16];
+  struct stat st;
+  int i, n, fd, t0, t1, t2, t3;
+
+  n = N;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n <= 0 || n > 30000){
+    printf("usage: dirbench [names <= 30000]\n");
+    exit(1);
+  }
+
+  if(mkdir("dbdir") < 0)
+    fail("mkdir", "dbdir");
+  if((fd = open("dbdir/target", O_CREATE|O_WRONLY)) < 0)
+    fail("create", "dbdir/target");
+  close(fd);
+
+  printf("dirbench: %d names\n", n);
+  strcpy(path, "dbdir/");
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, i);
+    strcpy(path + 6, name);
+    if(link("dbdir/target", path) < 0)
+      fail("link", path);
+  }
+
+  t1 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, i);
+    strcpy(path + 6, name);
+    if(stat(path, &st) < 0 || st.nlink != n+1)
+      fail("stat", path);
+  }
+
+  t2 = uptime();
+  for(i = 0; i < n; i++){
+    mkname(name, i);
+    strcpy(path + 6, name);
+    if(unlink(path) < 0)
+      fail("unlink", path);
+  }
+  t3 = uptime();
+
+  if(unlink("dbdir/target") < 0)
+    fail("unlink", "dbdir/target");
+  if(unlink("dbdir") < 0)
+    fail("unlink", "dbdir");
+
+  printf("dirbench: create %d ticks, stat %d ticks, unlink %d ticks\n",
+         t1 - t0, t2 - t1, t3 - t2);
+  exit(0);
+}
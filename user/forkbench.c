@@ -0,0 +1,49 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Time fork() of processes with larger and larger images.
+// Each child writes one page and exits, as a child about
+// to call exec() would, so with copy-on-write the cost
+// should barely depend on the size of the parent.
+
+#define N 200
+
+int
+main(int argc, char *argv[])
+{
+  static int sizes[] = { 0, 1, 4, 16 };  // MiB of heap
+  char *base, *p;
+  int i, j, pid, t0, t1, mb, grown;
+
+  base = sbrk(0);
+  grown = 0;
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    mb = sizes[i];
+    if(sbrk(mb*1024*1024 - grown) == (char*)-1){
+      printf("forkbench: sbrk failed\n");
+      exit(1);
+    }
+    for(p = base + grown; p < base + mb*1024*1024; p += 4096)
+      *p = 1;
+    grown = mb*1024*1024;
+
+    t0 = uptime();
+    for(j = 0; j < N; j++){
+      pid = fork();
+      if(pid < 0){
+        printf("forkbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0){
+        if(grown > 0)
+          base[0] = 2;
+        exit(0);
+      }
+      wait(0);
+    }
+    t1 = uptime();
+    printf("forkbench: %d MiB: %d forks in %d ticks\n", mb, N, t1 - t0);
+  }
+  exit(0);
+}
@@ -0,0 +1,122 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+// Time how quickly an interactive process gets the CPU while
+// CPU-bound processes compete for it. An echo child answers
+// each byte sent to it down a pipe; the parent times round
+// trips, sleeping a tick before each as someone typing would.
+// This is done on an idle machine, alongside spinning
+// processes, and alongside spinning processes that have
+// lowered their own priority with nice().
+
+#define ROUNDS 20
+#define NSPIN  8
+
+int spin[NSPIN];
+
+void
+fail(char *what)
+{
+  printf("latbench: %s failed\n", what);
+  exit(1);
+}
+
+void
+startspin(int n, int lowered)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if((spin[i] = fork()) < 0)
+      fail("fork");
+    if(spin[i] == 0){
+      if(lowered && nice(0, NPRIO-1) < 0)
+        fail("nice");
+      for(;;)
+        ;
+    }
+  }
+}
+
+void
+stopspin(int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    kill(spin[i]);
+    wait(0);
+  }
+}
+
+// returns the microseconds ROUNDS round trips took,
+// not counting the time slept before each.
+uint64
+roundtrips(int to, int from)
+{
+  uint64 t, t0, t1;
+  int i;
+  char c;
+
+  t = 0;
+  for(i = 0; i < ROUNDS; i++){
+    sleep(1);
+    nanotime(&t0);
+    c = i;
+    if(write(to, &c, 1) != 1 || read(from, &c, 1) != 1 || c != (char)i)
+      fail("round trip");
+    nanotime(&t1);
+    t += t1 - t0;
+  }
+  return t / 1000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int down[2], up[2], pid, n;
+  uint64 idle, loaded, lowered;
+  char c;
+
+  n = NSPIN;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n <= 0 || n > NSPIN){
+    printf("usage: latbench [spinners <= %d]\n", NSPIN);
+    exit(1);
+  }
+
+  if(pipe(down) < 0 || pipe(up) < 0)
+    fail("pipe");
+  if((pid = fork()) < 0)
+    fail("fork");
+  if(pid == 0){
+    close(down[1]);
+    close(up[0]);
+    while(read(down[0], &c, 1) == 1)
+      write(up[1], &c, 1);
+    exit(0);
+  }
+  close(down[0]);
+  close(up[1]);
+
+  idle = roundtrips(down[1], up[0]);
+
+  startspin(n, 0);
+  loaded = roundtrips(down[1], up[0]);
+  stopspin(n);
+
+  startspin(n, 1);
+  lowered = roundtrips(down[1], up[0]);
+  stopspin(n);
+
+  close(down[1]);
+  wait(0);
+
+  printf("latbench: %d round trips with %d spinners\n", ROUNDS, n);
+  printf("latbench: idle %l us, loaded %l us, niced load %l us\n",
+         idle, loaded, lowered);
+  exit(0);
+}
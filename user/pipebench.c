@@ -0,0 +1,58 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Time moving data through a pipe from a child to its
+// parent, which mostly measures copying between the kernel
+// and user memory.
+
+#define MB    (1024*1024)
+#define TOTAL (16*MB)   // bytes moved for each buffer size
+
+char buf[8192];
+
+int
+main(int argc, char *argv[])
+{
+  static int sizes[] = { 64, 512, 8192 };
+  int i, n, fds[2], pid, t0, t1, sz, xstatus;
+  long got;
+
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    sz = sizes[i];
+    if(pipe(fds) < 0){
+      printf("pipebench: pipe failed\n");
+      exit(1);
+    }
+    t0 = uptime();
+    pid = fork();
+    if(pid < 0){
+      printf("pipebench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      for(got = 0; got < TOTAL; got += sz){
+        if(write(fds[1], buf, sz) != sz){
+          printf("pipebench: write failed\n");
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+    close(fds[1]);
+    got = 0;
+    while((n = read(fds[0], buf, sz)) > 0)
+      got += n;
+    close(fds[0]);
+    wait(&xstatus);
+    t1 = uptime();
+    if(got != TOTAL || xstatus != 0){
+      printf("pipebench: moved %d bytes of %d\n", (int)got, TOTAL);
+      exit(1);
+    }
+    printf("pipebench: %d MiB in %d-byte writes: %d ticks\n",
+           TOTAL/MB, sz, t1 - t0);
+  }
+  exit(0);
+}
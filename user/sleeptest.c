@@ -0,0 +1,71 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Check that sleep() lasts as long as asked: NSLEEP processes
+// sleep for lengths from 1 tick to more than a lap of the
+// kernel's timer wheel, and each reports, through its exit
+// status, how late it woke up. Then check that a process
+// killed in a long sleep() exits right away.
+
+#define NSLEEP  40
+#define LATE    3      // ticks late that count as a failure
+
+int
+length(int i)
+{
+  return 1 + i*i/5;     // 1 to 305 ticks
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, pid, t0, xstate, late, worst;
+
+  for(i = 0; i < NSLEEP; i++){
+    if((pid = fork()) < 0){
+      printf("sleeptest: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      t0 = uptime();
+      if(sleep(length(i)) < 0)
+        exit(-1);
+      late = uptime() - t0 - length(i);
+      exit(late < 0 ? -1 : late);
+    }
+  }
+  worst = 0;
+  for(i = 0; i < NSLEEP; i++){
+    if(wait(&xstate) < 0 || xstate < 0){
+      printf("sleeptest: a sleep ended early\n");
+      exit(1);
+    }
+    if(xstate > worst)
+      worst = xstate;
+  }
+  printf("sleeptest: %d sleeps, at worst %d ticks late\n", NSLEEP, worst);
+  if(worst > LATE){
+    printf("sleeptest: too late\n");
+    exit(1);
+  }
+
+  if((pid = fork()) < 0){
+    printf("sleeptest: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    sleep(100000);
+    exit(0);
+  }
+  sleep(2);
+  t0 = uptime();
+  kill(pid);
+  wait(0);
+  if(uptime() - t0 > LATE){
+    printf("sleeptest: killed sleeper took %d ticks to exit\n", uptime() - t0);
+    exit(1);
+  }
+  printf("sleeptest: OK\n");
+  exit(0);
+}
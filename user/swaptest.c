@@ -0,0 +1,64 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Use more memory than the machine has, so that the kernel
+// must swap some of it out, and check that every page comes
+// back with what was written to it. The heap is written, and
+// then read back twice.
+
+#define MB      (1024*1024)
+#define PGSIZE  4096
+
+int
+check(char *a, int sz, int pass)
+{
+  int *p;
+
+  for(p = (int*)a; (char*)p < a + sz; p += PGSIZE/sizeof(int)){
+    if(p[0] != (char*)p - a || p[1] != pass){
+      printf("swaptest: page at %p holds %d %d\n", p, p[0], p[1]);
+      return -1;
+    }
+    p[1] = pass + 1;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *a;
+  int *p;
+  int sz, t0, t1, t2;
+
+  sz = 160;
+  if(argc > 1)
+    sz = atoi(argv[1]);
+  if(sz <= 0 || sz > 180){
+    printf("usage: swaptest [megabytes <= 180]\n");
+    exit(1);
+  }
+  printf("swaptest: %d MB\n", sz);
+  sz *= MB;
+
+  a = sbrk(sz);
+  if(a == (char*)-1){
+    printf("swaptest: sbrk failed\n");
+    exit(1);
+  }
+
+  t0 = uptime();
+  for(p = (int*)a; (char*)p < a + sz; p += PGSIZE/sizeof(int)){
+    p[0] = (char*)p - a;
+    p[1] = 0;
+  }
+  t1 = uptime();
+  if(check(a, sz, 0) < 0 || check(a, sz, 1) < 0)
+    exit(1);
+  t2 = uptime();
+
+  printf("swaptest: write %d ticks, read back %d ticks\n", t1 - t0, t2 - t1);
+  printf("swaptest: OK\n");
+  exit(0);
+}
@@ -0,0 +1,69 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+// Time a loop that touches one word in each page of a large
+// heap, so that nearly every access misses in the TLB. The
+// heap is first mapped with megapages; a fork() then makes
+// the kernel split them into ordinary pages, and the same
+// loop is timed again.
+
+#define MB      (1024*1024)
+#define SZ      (32*MB)   // bytes of heap walked
+#define ROUNDS  200
+#define PGSIZE  4096
+
+int
+walkheap(char *a)
+{
+  int r, sum;
+  char *p;
+
+  sum = 0;
+  for(r = 0; r < ROUNDS; r++)
+    for(p = a; p < a + SZ; p += PGSIZE + 64)
+      sum += *p;
+  return sum;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *a, *p;
+  int pid, t0, t1, t2, t3, s1, s2;
+
+  // align the heap to a megapage.
+  a = sbrk(0);
+  if(sbrk((2*MB - (uint64)a % (2*MB)) % (2*MB) + SZ) == (char*)-1){
+    printf("tlbbench: sbrk failed\n");
+    exit(1);
+  }
+  a += (2*MB - (uint64)a % (2*MB)) % (2*MB);
+  for(p = a; p < a + SZ; p += PGSIZE)
+    *p = 1;
+
+  t0 = uptime();
+  s1 = walkheap(a);
+  t1 = uptime();
+
+  pid = fork();
+  if(pid < 0){
+    printf("tlbbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
+  wait(0);
+
+  t2 = uptime();
+  s2 = walkheap(a);
+  t3 = uptime();
+
+  if(s1 != s2){
+    printf("tlbbench: sums differ\n");
+    exit(1);
+  }
+  printf("tlbbench: %d MiB x %d: megapages %d ticks, pages %d ticks\n",
+         SZ/MB, ROUNDS, t1 - t0, t3 - t2);
+  exit(0);
+}
@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct bcstat;
 
 // system calls
 int fork(void);
@@ -24,6 +25,14 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int ntas();
+int bcstat(struct bcstat*);
+int readahead(int);
+int fsync(int);
+void *mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int nice(int, int);
+int nanotime(uint64*);
+int nanosleep(uint64);
 int crash(const char*, int);
 int mount(char*, char *);
 int umount(char*);
@@ -177,6 +177,60 @@ writetest(char *s)
   }
 }
 
+// fsync() of files while other processes write.
+void
+fsynctest(char *s)
+{
+  int fd, i, pid, xstatus;
+  int fds[2];
+  enum { N=4, NW=20 };
+
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      char name[3] = { 'f', '0' + i, 0 };
+      fd = open(name, O_CREATE|O_RDWR);
+      if(fd < 0){
+        printf("%s: create %s failed\n", s, name);
+        exit(1);
+      }
+      for(int j = 0; j < NW; j++){
+        if(write(fd, "aaaaaaaaaa", 10) != 10){
+          printf("%s: write failed\n", s);
+          exit(1);
+        }
+        if(fsync(fd) != 0){
+          printf("%s: fsync failed\n", s);
+          exit(1);
+        }
+      }
+      close(fd);
+      unlink(name);
+      exit(0);
+    }
+  }
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1){
+    printf("%s: fsync of a pipe succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
 void
 writebig(char *s)
 {
@@ -1796,6 +1850,77 @@ sbrkarg(char *s)
   } 
 }
 
+// sbrk() allocates pages when they are first touched;
+// untouched pages must read as zero, in the process
+// itself, in a forked child, and through the kernel.
+void
+sbrklazy(char *s)
+{
+  enum { BIG=32*1024*1024 };
+  char *a, *p;
+  int i, fd, pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += 64*PGSIZE){
+    if(*p != 0){
+      printf("%s: untouched page not zero\n", s);
+      exit(1);
+    }
+    *p = 1;
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + BIG; p += 64*PGSIZE){
+      if(p[0] != 1 || p[PGSIZE] != 0){
+        printf("%s: child sees wrong contents\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  // the kernel writes to and reads from untouched pages.
+  fd = open("README", O_RDONLY);
+  if(fd < 0 || read(fd, a + 3*PGSIZE - 10, 20) != 20){
+    printf("%s: read into untouched pages failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("sbrklazy", O_CREATE|O_WRONLY);
+  if(fd < 0 || write(fd, a + 5*PGSIZE, PGSIZE) != PGSIZE){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("sbrklazy");
+
+  if(sbrk(-BIG) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(-%d) failed\n", s, BIG);
+    exit(1);
+  }
+  for(i = 0; i < 2; i++){
+    a = sbrk(PGSIZE);
+    if(*a != 0){
+      printf("%s: re-allocated page not zero\n", s);
+      exit(1);
+    }
+    *a = 1;
+    sbrk(-PGSIZE);
+  }
+}
+
 void
 validatetest(char *s)
 {
@@ -2151,10 +2276,12 @@ main(int argc, char *argv[])
     {kernmem, "kernmem"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
+    {sbrklazy, "sbrklazy"},
     {validatetest, "validatetest"},
     {stacktest, "stacktest"},
     {opentest, "opentest"},
     {writetest, "writetest"},
+    {fsynctest, "fsynctest"},
     {writebig, "writebig"},
     {createtest, "createtest"},
     {openiputtest, "openiput"},
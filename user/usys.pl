@@ -37,3 +37,11 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("ntas");
+entry("bcstat");
+entry("readahead");
+entry("fsync");
+entry("mmap");
+entry("munmap");
+entry("nice");
+entry("nanotime");
+entry("nanosleep");
@@ -0,0 +1,125 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+// Time workloads that sleep and wake up a lot, with 1, 2, 4
+// and 8 copies running at once, next to NIDLE processes that
+// sleep throughout: pairs of processes bouncing a byte
+// through pipes, and processes writing, reading back and
+// removing files. Every copy does the same work, so with
+// enough CPUs the ticks should stay flat as copies are added.
+
+#define NIDLE   32
+#define ROUNDS  2000   // round trips per pair
+#define NFILE   10     // files per writer
+#define FILESZ  8192
+
+char buf[FILESZ];
+
+void
+fail(char *what)
+{
+  printf("wakebench: %s failed\n", what);
+  exit(1);
+}
+
+void
+pingpong(void)
+{
+  int a[2], b[2], i;
+  char c;
+
+  if(pipe(a) < 0 || pipe(b) < 0)
+    fail("pipe");
+  if(fork() == 0){
+    for(i = 0; i < ROUNDS; i++)
+      if(read(a[0], &c, 1) != 1 || write(b[1], &c, 1) != 1)
+        fail("echo");
+    exit(0);
+  }
+  for(i = 0; i < ROUNDS; i++)
+    if(write(a[1], &c, 1) != 1 || read(b[0], &c, 1) != 1)
+      fail("ping");
+  wait(0);
+  exit(0);
+}
+
+void
+writer(int id)
+{
+  char name[8];
+  int i, fd;
+
+  name[0] = 'w';
+  name[1] = '0' + id;
+  name[3] = '\0';
+  for(i = 0; i < NFILE; i++){
+    name[2] = '0' + i;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0)
+      fail("create");
+    if(write(fd, buf, FILESZ) != FILESZ)
+      fail("write");
+    close(fd);
+    if((fd = open(name, O_RDONLY)) < 0 || read(fd, buf, FILESZ) != FILESZ)
+      fail("read");
+    close(fd);
+    if(unlink(name) < 0)
+      fail("unlink");
+  }
+  exit(0);
+}
+
+// Run n copies of job, and return the ticks they took.
+int
+run(int n, int pipes)
+{
+  int i, pid, t0;
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0){
+      if(pipes)
+        pingpong();
+      else
+        writer(i);
+    }
+  }
+  for(i = 0; i < n; i++)
+    wait(0);
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int idle[2], pid, i, n;
+  char c;
+
+  // idle processes, asleep in read() until the end.
+  if(pipe(idle) < 0)
+    fail("pipe");
+  for(i = 0; i < NIDLE; i++){
+    if((pid = fork()) < 0)
+      fail("fork");
+    if(pid == 0){
+      close(idle[1]);
+      read(idle[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(idle[0]);
+
+  printf("wakebench: %d idle processes\n", NIDLE);
+  for(n = 1; n <= 8; n *= 2)
+    printf("wakebench: %d ping-pong pairs: %d ticks\n", n, run(n, 1));
+  for(n = 1; n <= 8; n *= 2)
+    printf("wakebench: %d file writers: %d ticks\n", n, run(n, 0));
+
+  close(idle[1]);
+  for(i = 0; i < NIDLE; i++)
+    wait(0);
+  exit(0);
+}